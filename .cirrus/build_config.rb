@@ -3,7 +3,9 @@ MRuby::Build.new do
   enable_bintest
   enable_test
   enable_debug
-  gem File.join(__dir__, "..")
+  gem File.join(__dir__, "..") do |g|
+    g.add_profile "printer", %w(print sprintf)
+  end
   gem File.join(__dir__, "../testgem")
   gem core: "mruby-compiler"
   gem core: "mruby-sprintf"
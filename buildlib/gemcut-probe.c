@@ -0,0 +1,154 @@
+#include <mruby-gemcut.h>
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * gem ごとの初期化の費用を計測し、タブ区切りで標準出力に書き出す。
+ * buildlib/internals.rb の gemcut:probe タスクがビルドし、実行する。
+ *
+ *      # name  init_ns  objects  bytes
+ *      mruby-math      1234    5       6789
+ *
+ * gem ごとに新しい mrb_state を作り、依存する gem を先に初期化してから、その gem だけを初期化する。
+ * 時間、生存オブジェクトの増分、確保したメモリの量はそれぞれ独立に中央値を取る。
+ * 反復回数は第 1 引数で変更できる。
+ */
+
+struct probe_counter
+{
+  size_t bytes;
+};
+
+static void *
+probe_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  (void)mrb;
+
+  if (size == 0) {
+    free(p);
+    return NULL;
+  }
+
+  ((struct probe_counter *)ud)->bytes += size;
+  return realloc(p, size);
+}
+
+static uint64_t
+probe_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int
+probe_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t
+probe_median(uint64_t samples[], int num)
+{
+  qsort(samples, num, sizeof(samples[0]), probe_compare);
+  return samples[num / 2];
+}
+
+/*
+ * name の依存関係を初期化した mrb_state で name だけを初期化し、その費用を記録する。
+ */
+static int
+probe_once(const char *name, uint64_t *ns, uint64_t *objects, uint64_t *bytes)
+{
+  struct probe_counter counter = { 0 };
+  mrb_state *mrb = mrb_open_core(probe_allocf, &counter);
+  if (mrb == NULL) {
+    return -1;
+  }
+
+  /* 閉包の最後は name 自身 */
+  mrb_value deps = mruby_gemcut_closure(mrb, name, TRUE);
+  if (mrb_exception_p(deps)) {
+    mrb_close(mrb);
+    return -1;
+  }
+  for (mrb_int i = 0; i + 1 < RARRAY_LEN(deps); i++) {
+    mrb_value dep = RARRAY_PTR(deps)[i];
+    if (mrb_exception_p(mruby_gemcut_require(mrb, RSTRING_PTR(dep)))) {
+      mrb_close(mrb);
+      return -1;
+    }
+  }
+
+  mrb_full_gc(mrb);
+  size_t live = mrb->gc.live;
+  counter.bytes = 0;
+
+  uint64_t t = probe_now();
+  mrb_value ret = mruby_gemcut_require(mrb, name);
+  *ns = probe_now() - t;
+  *bytes = counter.bytes;
+
+  mrb_full_gc(mrb);
+  *objects = (mrb->gc.live > live) ? (uint64_t)(mrb->gc.live - live) : 0;
+
+  mrb_close(mrb);
+
+  return mrb_exception_p(ret) ? -1 : 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int runs = (argc > 1) ? atoi(argv[1]) : 31;
+  if (runs < 1) {
+    runs = 1;
+  }
+
+  uint64_t *samples = (uint64_t *)malloc(sizeof(uint64_t) * 3 * runs);
+  if (samples == NULL) {
+    fputs("out of memory\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+  if (mrb == NULL) {
+    fputs("mrb_open_core failed\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+  mrb_value list = mruby_gemcut_loadable_features(mrb);
+  puts("# name\tinit_ns\tobjects\tbytes");
+  for (mrb_int i = 0; i < RARRAY_LEN(list); i++) {
+    const char *name = RSTRING_PTR(RARRAY_PTR(list)[i]);
+    int r;
+    for (r = 0; r < runs; r++) {
+      if (probe_once(name, &samples[r], &samples[runs + r], &samples[runs * 2 + r]) != 0) {
+        break;
+      }
+    }
+
+    if (r < runs) {
+      fprintf(stderr, "%s: failed to initialize\n", name);
+      status = EXIT_FAILURE;
+      continue;
+    }
+
+    printf("%s\t%llu\t%llu\t%llu\n", name,
+           (unsigned long long)probe_median(samples, runs),
+           (unsigned long long)probe_median(samples + runs, runs),
+           (unsigned long long)probe_median(samples + runs * 2, runs));
+  }
+
+  mrb_close(mrb);
+  free(samples);
+
+  return status;
+}
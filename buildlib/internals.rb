@@ -1,3 +1,5 @@
+require "tsort"
+
 begin
   require "mruby/source"
 rescue LoadError
@@ -10,6 +12,119 @@ module Gemcut
     MRuby::Source::MRUBY_RELEASE_NO < 30100 and !File.exist?(File.join(MRUBY_ROOT, "mrbgems/mruby-binding"))
   end
 
+  # `src/mruby-gemcut.c` の gemcut_hash() と同じ計算を行う
+  def Gemcut.fnv1a32(str)
+    str.each_byte.inject(0x811c9dc5) { |h, b| ((h ^ b) * 0x01000193) & 0xffffffff }
+  end
+
+  # 依存される gem が先に来るように並べ替える
+  # 依存関係が循環している場合は例外を発生させる
+  def Gemcut.tsort_gems(gems)
+    table = gems.each_with_object({}) { |g, a| a[g[0]] = g }
+    each_node = ->(&b) { gems.each { |(name, *)| b.(name) } }
+    each_child = ->(name, &b) {
+      table[name][3].each { |d|
+        raise "#{d.inspect} required by #{name.inspect} is not found" unless table.key?(d)
+        b.(d)
+      }
+    }
+
+    sorted = []
+    TSort.each_strongly_connected_component(each_node, each_child) do |names|
+      if names.size > 1 || table[names[0]][3].include?(names[0])
+        raise "circular dependency detected in gems (#{names.join(", ")})"
+      end
+      sorted << table[names[0]]
+    end
+
+    sorted
+  end
+
+  # C の識別子として使える名前に変換する
+  def Gemcut.cname(name)
+    name.to_s.gsub(/[^0-9A-Za-z_]+/, "_")
+  end
+
+  def Gemcut.bitmap_units(ids, nunits, unit_bits)
+    ids.each_with_object(Array.new(nunits, 0)) { |id, a| a[id / unit_bits] |= 1 << (id % unit_bits) }
+  end
+
+  # gem が定義するトップレベルの定数と Kernel (Object) のメソッドを、ソースコードから大まかに拾い出す
+  # mruby 本体がすでに持つ定数 (再オープンされたクラスやモジュール) とメソッドは除く
+  def Gemcut.scan_autoload(gem)
+    consts, methods = scan_sources(Dir.glob(File.join(gem.dir, "src/**/*.{c,cc,cpp,cxx}")).sort, Array(gem.rbfiles))
+    core_consts, core_methods = scan_core
+    [consts - core_consts, methods - core_methods]
+  end
+
+  # 本体のソースコードからは拾いきれない、起動時に作られるクラスと mruby 自身が呼び出すフックメソッド
+  CORE_BOOT_CONSTS = %w(BasicObject Object Module Class)
+  CORE_HOOK_METHODS = %w(
+    method_missing respond_to_missing? const_missing initialize initialize_copy
+    inherited included extended prepended method_added singleton_method_added
+  )
+
+  def Gemcut.scan_core
+    @scan_core ||= begin
+      consts, methods = scan_sources(Dir.glob(File.join(MRUBY_ROOT, "src/*.c")).sort,
+                                     Dir.glob(File.join(MRUBY_ROOT, "mrblib/*.rb")).sort)
+      [consts | CORE_BOOT_CONSTS, methods | CORE_HOOK_METHODS]
+    end
+  end
+
+  def Gemcut.scan_sources(csrcs, rbfiles)
+    consts = []
+    methods = []
+
+    csrcs.each do |path|
+      src = File.read(path, mode: "rb")
+
+      objs = %w(mrb->object_class)
+      src.scan(/\b(\w+)\s*=\s*mrb->object_class\s*;/) { objs << $1 }
+      recv = %w(mrb->kernel_module) + objs
+      src.scan(/\b(\w+)\s*=\s*mrb->kernel_module\s*;/) { recv << $1 }
+      src.scan(/\b(\w+)\s*=\s*mrb_define_module\s*\(\s*\w+\s*,\s*"Kernel"\s*\)/) { recv << $1 }
+      objs = Regexp.union(objs.uniq)
+      recv = Regexp.union(recv.uniq)
+
+      src.scan(/\bmrb_define_(?:class|module)\s*\(\s*\w+\s*,\s*"([A-Z]\w*)"/) { consts << $1 }
+      src.scan(/\bmrb_define_(?:class|module)_under\s*\(\s*\w+\s*,\s*#{objs}\s*,\s*"([A-Z]\w*)"/) { consts << $1 }
+      src.scan(/\bmrb_define_global_const\s*\(\s*\w+\s*,\s*"([A-Z]\w*)"/) { consts << $1 }
+      src.scan(/\bmrb_define_(?:method|private_method|module_function)\s*\(\s*\w+\s*,\s*#{recv}\s*,\s*"([a-z_]\w*[?!]?)"/) { methods << $1 }
+    end
+
+    rbfiles.each do |path|
+      kernel = false
+      File.foreach(path, mode: "rb") do |line|
+        case line
+        when /\A(?:class|module)\s+([A-Z]\w*)\b/
+          consts << $1
+          kernel = ($1 == "Kernel" || $1 == "Object")
+        when /\Aend\b/
+          kernel = false
+        when /\Adef\s+([a-z_]\w*[?!]?)/
+          methods << $1
+        when /\A\s{1,4}def\s+([a-z_]\w*[?!]?)/
+          methods << $1 if kernel
+        end
+      end
+    end
+
+    [consts.uniq, methods.uniq]
+  end
+
+  # gemcut-probe が書き出した "名前<TAB>ナノ秒<TAB>オブジェクト数<TAB>バイト数" の行を読み込む
+  # ファイルがなければ空のハッシュを返す
+  def Gemcut.read_costs(path)
+    return {} unless File.exist?(path)
+
+    File.foreach(path, mode: "rb").each_with_object({}) do |line, a|
+      name, *values = line.chomp.split("\t")
+      next if name.nil? || name.start_with?("#") || values.size != 3
+      a[name] = values.map { |v| [Integer(v), 0xffffffff].min }
+    end
+  end
+
   module Internals
     if Object.const_defined?(:MiniRake)
       refine MiniRake::Task do
@@ -25,26 +140,98 @@ module Gemcut
         gemcut_o = File.join(build_dir, "src/mruby-gemcut.c").ext(exts.object)
         cc.include_paths << hdrgendir
         file gemcut_o => [File.join(dir, "src/mruby-gemcut.c"), deps_h]
-        file deps_h => [__FILE__, File.join(build.build_dir, "mrbgems/gem_init.c")] do |t|
+        costs_tsv = File.join(build.build_dir, "gemcut-costs.tsv")
+        deps_prereqs = [__FILE__, File.join(build.build_dir, "mrbgems/gem_init.c")]
+        deps_prereqs << costs_tsv if File.exist?(costs_tsv)
+        file deps_h => deps_prereqs do |t|
           # NOTE: file タスク中であれば build.gems はすでに依存関係が解決されている状態。
 
           verbose = Rake.respond_to?(:verbose) ? Rake.verbose : $-v
           puts %(GEN   #{t.name}#{verbose ? " (by #{__FILE__})" : nil}\n)
 
-          gindex = {}
-          gems = build.gems.map.with_index do |g, i|
+          gems = build.gems.map do |g|
             name = g.name.to_s
-            cname = name.gsub(/[^0-9A-Za-z_]+/, "_")
-            gindex[name] = i
+            cname = Gemcut.cname(name)
             [name, cname, g, g.dependencies.map { |e| e[:gem].to_s }, !@blacklist.include?(name)]
           end
 
-          gemcut_max_gems = 4000
-          if gems.size > gemcut_max_gems
-            raise "The allowable gem number in '#{s.name}' has been exceeded (maximum #{gemcut_max_gems})"
+          # 番号の昇順がそのまま初期化の順序となるように並べ替える
+          gems = Gemcut.tsort_gems(gems)
+          gindex = Hash[gems.each_with_index.map { |(name, *), i| [name, i] }]
+
+          # gem の並びと依存関係から求めるビルドの識別子
+          # 番号の意味が変わらない限り同じ値となり、フィンガープリントの互換性を確かめるのに使う
+          build_id = Gemcut.fnv1a32(gems.map { |(name, cname, gem, deps)| [name, *deps.sort].join(",") }.join("\n"))
+
+          unit_bits = 64
+          bitmap_units = gems.empty? ? 1 : (gems.size + (unit_bits - 1)) / unit_bits
+
+          # 自身を含む、推移的に依存する全ての gem
+          closures = []
+          gems.each_with_index do |(name, cname, gem, deps, avail), i|
+            closures << deps.each_with_object([i]) { |d, a| a.concat closures[gindex[d]] }.uniq.sort
+          end
+
+          # 名前付きの gem の組み合わせ
+          profiles = @profiles.map do |pname, members|
+            ids = members.map { |m|
+              id = gindex[m] || gindex["mruby-#{m}"]
+              raise "#{m.inspect} in gemcut profile #{pname.inspect} is not found" unless id
+              raise "#{m.inspect} in gemcut profile #{pname.inspect} is blacklisted" unless gems[id][4]
+              closures[id]
+            }.flatten.uniq.sort
+            [pname, ids, Gemcut.cname(pname)]
+          end
+          profiles.group_by { |*, pcname| pcname }.each_value do |ps|
+            next if ps.size < 2
+            raise "gemcut profiles #{ps.map { |pname, *| pname.inspect }.join(", ")} have the same C name"
           end
 
-          unit_bits = 32
+          # 遅延読み込みのための、定数名・メソッド名から gem を引く表
+          # 複数の gem が同じ名前を定義している場合は、先に初期化される gem を選ぶ
+          autoload_consts = {}
+          autoload_methods = {}
+          gems.each_with_index do |(name, cname, gem, deps, avail), i|
+            next unless avail && gem.generate_functions && name != "mruby-gemcut"
+            consts, methods = Gemcut.scan_autoload(gem)
+            consts.each { |c| autoload_consts[c] ||= i }
+            methods.each { |m| autoload_methods[m] ||= i }
+          end
+          # Ruby で書かれた部分 (mrblib) を持つ gem
+          mrblib_ids = gems.each_index.select { |i| gems[i][2].generate_functions && !Array(gems[i][2].rbfiles).empty? }
+          # gem_final で何かを行う gem
+          # mruby は src を持たない gem の gem_final を空の関数として生成するため、それらは除く
+          # mruby-gemcut 自身の gem_final は何もしない
+          finalizer_ids = gems.each_index.select { |i|
+            gem = gems[i][2]
+            gem.generate_functions && gems[i][0] != "mruby-gemcut" &&
+              Array(gem.objs).any? { |o| File.basename(o.to_s, ".*") != "gem_init" }
+          }
+
+          # gemcut:probe タスクで計測した、gem ごとの初期化の費用 (中央値)
+          costs = Gemcut.read_costs(costs_tsv)
+
+          autoload_table = ->(table) {
+            table.sort.map { |n, id| %({ #{n.inspect}, #{id} }, /* #{gems[id][0]} */\n  ) }.join + "{ NULL, -1 }"
+          }
+
+          # gem 名の検索表 (FNV-1a によるオープンアドレス法)
+          # "mruby-" を省いた名前も、完全な名前と衝突しない限り同じ表に載せる
+          names = gems.each_with_index.map { |(name, *), i| [name, i, false] }
+          gems.each_with_index do |(name, *), i|
+            abbr = name.sub(/\Amruby-/, "")
+            next if abbr == name || gindex.key?(abbr)
+            names << [abbr, i, true]
+          end
+          index_size = 2
+          index_size <<= 1 while index_size < names.size * 2
+          index = Array.new(index_size)
+          names.each do |name, id, abbrev|
+            hash = Gemcut.fnv1a32(name)
+            slot = hash
+            slot += 1 while index[slot & (index_size - 1)]
+            index[slot & (index_size - 1)] = [name, hash, id, abbrev]
+          end
 
           FileUtils.mkpath File.dirname t.name
           File.write t.name, <<~"DEPS_H", mode: "wb"
@@ -57,9 +244,13 @@ module Gemcut
 
             #define MRUBY_GEMCUT_ID #{gems.index { |name, *| name == "mruby-gemcut" }}
             #define MGEMS_POPULATION #{gems.size}
-            #define MGEMS_BITMAP_UNITS #{gems.empty? ? 1 : (gems.size + (unit_bits - 1)) / unit_bits}
+            #define MGEMS_BITMAP_UNITS #{bitmap_units}
             #define MGEMS_UNIT_BITS #{unit_bits}
-            typedef uint32_t bitmap_unit;
+            typedef uint64_t bitmap_unit;
+            #define MGEMS_NAME_MAX #{names.map { |name, *| name.bytesize }.max || 0}
+            #define MGEMS_INDEX_SIZE #{index_size}
+            #define MGEMS_HAVE_COSTS #{costs.empty? ? 0 : 1}
+            #define MGEMS_BUILD_ID 0x#{"%08x" % build_id}UL
 
             #{
               gems.each_with_object("") { |(name, cname, gem, deps, avail), a|
@@ -87,7 +278,7 @@ module Gemcut
                 deps = deps.map { |d| gindex[d] }.sort
                 deplist = deps.map { |d| %(#{d}) }.join(", ")
                 a << "\n" unless a.empty?
-                a << %(static const uint16_t deps_#{cname}[] = { #{deplist} };)
+                a << %(static const uint32_t deps_#{cname}[] = { #{deplist} };)
               }
             }
 
@@ -107,9 +298,124 @@ module Gemcut
                   end
 
                   no = "/* %3d */" % i
+                  cost = costs.fetch(name, [0, 0, 0]).join(", ")
 
                   a << ",\n  " unless a.empty?
-                  a << %(#{no} { #{name.inspect}, #{funcpair}, #{avail ? "TRUE" : "FALSE"}, #{deps.size}, #{depsname} })
+                  a << %(#{no} { #{name.inspect}, #{funcpair}, #{avail ? "TRUE" : "FALSE"}, #{deps.size}, #{depsname}, #{cost} })
+                }
+              }
+            };
+
+            /*
+             * 自身を含む、推移的に依存する gem の番号 (gem ごとに昇順)。
+             * gem i の分は mgems_closure_ids[mgems_closure_offset[i]] から mgems_closure_ids[mgems_closure_offset[i + 1]] の手前まで。
+             * gem の数の 2 乗に比例する大きさとならないように、ビットマップではなく番号の列で持つ。
+             * 番号の昇順に初期化すれば依存関係を満たす。
+             */
+            static const uint32_t mgems_closure_ids[] = {
+              #{
+                closures.each_with_object("").with_index { |(ids, a), i|
+                  no = "/* %3d */" % i
+                  a << ",\n  " unless a.empty?
+                  a << %(#{no} #{ids.join(", ")})
+                }
+              }
+            };
+
+            static const uint32_t mgems_closure_offset[MGEMS_POPULATION + 1] = {
+              #{closures.inject([0]) { |a, ids| a << a[-1] + ids.size }.each_slice(16).map { |l| l.join(", ") }.join(",\n  ")}
+            };
+
+            /* mrblib を持つ gem */
+            static const bitmap_unit mgems_mrblib[MGEMS_BITMAP_UNITS] = {
+              #{Gemcut.bitmap_units(mrblib_ids, bitmap_units, unit_bits).map { |u| "0x%016xULL" % u }.join(", ")}
+            };
+
+            /* gem_final で何かを行う gem。struct gemcut の記録簿にはこれらの gem だけが載る */
+            #define MGEMS_FINALIZERS #{finalizer_ids.size}
+            static const bitmap_unit mgems_finalizers[MGEMS_BITMAP_UNITS] = {
+              #{Gemcut.bitmap_units(finalizer_ids, bitmap_units, unit_bits).map { |u| "0x%016xULL" % u }.join(", ")}
+            };
+
+            #define MGEMS_PROFILES #{profiles.size}
+            #{
+              unless profiles.empty?
+                <<~PROFILES
+                  static const char *const mgems_profile_names[MGEMS_PROFILES] = {
+                    #{profiles.map { |pname, *| pname.inspect }.join(",\n  ")}
+                  };
+
+                  static const bitmap_unit mgems_profile_closure[MGEMS_PROFILES][MGEMS_BITMAP_UNITS] = {
+                    #{
+                      profiles.map { |pname, ids|
+                        units = Gemcut.bitmap_units(ids, bitmap_units, unit_bits)
+                        %({ #{units.map { |u| "0x%016xULL" % u }.join(", ")} } /* #{pname} */)
+                      }.join(",\n  ")
+                    }
+                  };
+
+                  /*
+                   * 検索も依存関係の解決も行わずに、プロファイルの gem を番号の昇順に初期化する。
+                   * gem_init の前に gemcut_profile_enter() で初期化済みの印を付け、終えたら gemcut_profile_done() で知らせる。
+                   * gemcut_profile_enter() は、それより前の gem_init の中から require されていた gem であれば false を返す。
+                   */
+                  struct gemcut_profile_progress;
+                  static bool gemcut_profile_enter(struct gemcut_profile_progress *progress, int id);
+                  static void gemcut_profile_done(struct gemcut_profile_progress *progress, int id);
+                  static mrb_value gemcut_profile_init(mrb_state *mrb, int profile, void (*body)(mrb_state *mrb, struct gemcut_profile_progress *progress));
+                  #{
+                    profiles.each_with_index.map { |(pname, ids, pcname), pi|
+                      calls = ids.map { |id|
+                        if gems[id][2].generate_functions
+                          "  if (gemcut_profile_enter(progress, #{id})) {\n" \
+                          "    aux_ignite_gem_init(mrb, GENERATED_TMP_mrb_#{gems[id][1]}_gem_init);\n" \
+                          "    gemcut_profile_done(progress, #{id});\n" \
+                          "  }\n"
+                        else
+                          "  gemcut_profile_enter(progress, #{id});\n"
+                        end
+                      }.join
+                      calls = "  (void)mrb;\n  (void)progress;\n" if calls.empty?
+                      <<~INIT
+                        static void
+                        gemcut_profile_body_#{pcname}(mrb_state *mrb, struct gemcut_profile_progress *progress)
+                        {
+                        #{calls.chomp}
+                        }
+
+                        MRB_API mrb_value
+                        mruby_gemcut_init_#{pcname}(mrb_state *mrb)
+                        {
+                          return gemcut_profile_init(mrb, #{pi}, gemcut_profile_body_#{pcname});
+                        }
+                      INIT
+                    }.join("\n")
+                  }
+                PROFILES
+              end
+            }
+            /* 名前の昇順 (strcmp) に並べ、番兵で終わる */
+            #define MGEMS_AUTOLOAD_CONSTS #{autoload_consts.size}
+            static const struct mgem_autoload mgems_autoload_consts[MGEMS_AUTOLOAD_CONSTS + 1] = {
+              #{autoload_table.(autoload_consts)}
+            };
+
+            #define MGEMS_AUTOLOAD_METHODS #{autoload_methods.size}
+            static const struct mgem_autoload mgems_autoload_methods[MGEMS_AUTOLOAD_METHODS + 1] = {
+              #{autoload_table.(autoload_methods)}
+            };
+
+            static const struct mgem_index mgems_index[MGEMS_INDEX_SIZE] = {
+              #{
+                index.each_with_object("").with_index { |(e, a), i|
+                  no = "/* %3d */" % i
+                  a << ",\n  " unless a.empty?
+                  if e
+                    name, hash, id, abbrev = e
+                    a << %(#{no} { #{name.inspect}, 0x%08xUL, #{id}, #{abbrev ? "TRUE" : "FALSE"} }) % hash
+                  else
+                    a << %(#{no} { NULL, 0, -1, FALSE })
+                  end
                 }
               }
             };
@@ -117,9 +423,55 @@ module Gemcut
         end
       end
 
+      # gem ごとの初期化の費用を計測して gemcut-costs.tsv に書き出すタスク
+      #
+      # 計測用の実行ファイルは libmruby とリンクするため、deps.h の生成より後でなければ作れない。
+      # そのため通常のビルドには含めず、`rake gemcut:probe` で明示的に実行する。
+      # 書き出した結果は、次のビルドで deps.h に埋め込まれる。
+      def make_probe_task
+        probedir = File.join(build_dir, "probe")
+        probe_src = File.join(dir, "buildlib/gemcut-probe.c")
+        probe_o = File.join(probedir, "gemcut-probe").ext(exts.object)
+        probe_exe = File.join(probedir, "gemcut-probe#{exts.executable}")
+        costs_tsv = File.join(build.build_dir, "gemcut-costs.tsv")
+        if build.respond_to?(:libmruby_static)
+          libmruby = build.libmruby_static
+        else
+          libmruby = build.libfile(File.join(build.build_dir, "lib/libmruby"))
+        end
+
+        file probe_o => [probe_src, File.join(build_dir, "include/mruby-gemcut/deps.h")] do |t|
+          cc.run t.name, probe_src
+        end
+
+        file probe_exe => [probe_o, libmruby] do |t|
+          build.linker.run t.name, t.prerequisites
+        end
+
+        task "gemcut:probe:#{build.name}" => probe_exe do
+          runs = Integer(ENV["GEMCUT_PROBE_RUNS"] || 31)
+          puts %(PROBE #{costs_tsv} (#{runs} runs)\n)
+          output = IO.popen([probe_exe, runs.to_s], "rb", &:read)
+          raise "#{probe_exe} failed" unless $?.success?
+          File.write costs_tsv, output, mode: "wb"
+        end
+
+        task "gemcut:probe" => "gemcut:probe:#{build.name}"
+      end
+
       def make_geminit_task
         file "#{build.build_dir}/mrbgems/gem_init.c" => [__FILE__] do |t|
           t.actions[1..-1] = []
+
+          if @default_profile
+            unless @profiles.key?(@default_profile)
+              raise "default gemcut profile #{@default_profile.inspect} is not declared with add_profile"
+            end
+            profinit = "mruby_gemcut_init_#{Gemcut.cname(@default_profile)}"
+            profdecl = "\nMRB_API mrb_value #{profinit}(mrb_state *);"
+            profcall = "\n  #{profinit}(mrb);"
+          end
+
           FileUtils.mkpath File.dirname(t.name)
           File.binwrite t.name, <<~CODE
             /*
@@ -130,7 +482,7 @@ module Gemcut
             #include <mruby.h>
 
             void GENERATED_TMP_mrb_mruby_gemcut_gem_init(mrb_state *);
-            void GENERATED_TMP_mrb_mruby_gemcut_gem_final(mrb_state *);
+            void GENERATED_TMP_mrb_mruby_gemcut_gem_final(mrb_state *);#{profdecl}
 
             static void
             mrb_final_mrbgems(mrb_state *mrb)
@@ -141,7 +493,7 @@ module Gemcut
             void
             mrb_init_mrbgems(mrb_state *mrb)
             {
-              GENERATED_TMP_mrb_mruby_gemcut_gem_init(mrb);
+              GENERATED_TMP_mrb_mruby_gemcut_gem_init(mrb);#{profcall}
               mrb_state_atexit(mrb, mrb_final_mrbgems);
             }
           CODE
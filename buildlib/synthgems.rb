@@ -0,0 +1,75 @@
+#!ruby
+
+require "fileutils"
+
+module Gemcut
+  # 大量の gem を扱えることを確かめるための、中身のない gem を生成する
+  module Synth
+    # 依存する gem の数ごとの重み (0 個, 1 個, 2 個)
+    # 平均が 1 を下回るため、依存関係の閉包は gem の総数に関わらず小さく収まる
+    DEPS_WEIGHTS = [5, 3, 2]
+
+    def Synth.name_of(i)
+      "synth-%05d" % i
+    end
+
+    # dir の下に count 個の gem を生成し、gem のディレクトリの配列を返す
+    # 依存先は常に自身より番号の小さい gem から選ぶため、依存関係は循環しない
+    # 内容が変わらないファイルは書き換えないため、再生成しても再コンパイルは起きない
+    def Synth.generate(dir, count, seed: 1)
+      rng = Random.new(seed)
+      total = DEPS_WEIGHTS.sum
+
+      (0...count).map do |i|
+        pick = rng.rand(total)
+        numdeps = DEPS_WEIGHTS.each_index.find { |n| (pick -= DEPS_WEIGHTS[n]) < 0 }
+        deps = (i > 0) ? Array.new(numdeps) { rng.rand(i) }.uniq.sort : []
+
+        name = name_of(i)
+        cname = name.tr("-", "_")
+        gemdir = File.join(dir, name)
+
+        Synth.update File.join(gemdir, "mrbgem.rake"), <<~RAKE
+          MRuby::Gem::Specification.new(#{name.inspect}) do |s|
+            s.summary = "synthetic gem for mruby-gemcut"
+            s.license = "CC0-1.0"
+            s.author  = "mruby-gemcut"
+          #{deps.map { |d| %(  add_dependency #{name_of(d).inspect}\n) }.join}end
+        RAKE
+
+        Synth.update File.join(gemdir, "src", "#{cname}.c"), <<~CODE
+          #include <mruby.h>
+
+          void
+          mrb_#{cname}_gem_init(mrb_state *mrb)
+          {
+            mrb_define_const(mrb, mrb->object_class, "Synth#{"%05d" % i}", mrb_fixnum_value(#{i}));
+          }
+
+          void
+          mrb_#{cname}_gem_final(mrb_state *mrb)
+          {
+            (void)mrb;
+          }
+        CODE
+
+        gemdir
+      end
+    end
+
+    def Synth.update(path, content)
+      return if File.exist?(path) && File.binread(path) == content
+      FileUtils.mkpath File.dirname(path)
+      File.binwrite path, content
+    end
+  end
+end
+
+if $0 == __FILE__
+  unless (2..3).include?(ARGV.size)
+    abort "usage: #{File.basename($0)} <output-dir> <count> [seed]"
+  end
+
+  dirs = Gemcut::Synth.generate(ARGV[0], Integer(ARGV[1]), seed: Integer(ARGV[2] || 1))
+  puts "#{dirs.size} gems in #{ARGV[0]}"
+end
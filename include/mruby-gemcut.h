@@ -28,6 +28,92 @@ MRB_API void mruby_gemcut_define_module(mrb_state *mrb);
  */
 MRB_API mrb_value mruby_gemcut_require(mrb_state *mrb, const char *name);
 
+/**
+ * 引数 +names+ に対する +num+ 個の gem をまとめて初期化します。
+ * 依存関係は一度に解決され、全ての初期化はひとつの保護区間の中で行われます。
+ *
+ * ひとつでも初期化した場合は +true+ を返します。すでに全て初期化されている場合は +false+ を返します。
+ * 不明な gem 名が含まれる場合は、何も初期化せずに +LoadError+ 例外となります。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_require_many(mrb_state *mrb, const char *const names[], size_t num);
+
+/**
+ * <tt>build_config.rb</tt> で +add_profile+ によって名前を付けた gem の組み合わせを初期化します。
+ * 依存関係はビルド時に解決されているため、gem 名の検索を行いません。
+ *
+ * ひとつでも初期化した場合は +true+ を返します。すでに全て初期化されている場合は +false+ を返します。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_require_profile(mrb_state *mrb, const char *name);
+
+/**
+ * +add_profile+ で宣言したプロファイルごとに生成される、+mruby_gemcut_init_<プロファイル名>()+ 関数を宣言します。
+ * プロファイル名のうち C の識別子に使えない文字は +_+ に置き換えられます。
+ *
+ *      MRUBY_GEMCUT_DECLARE_PROFILE_INIT(worker);
+ *
+ *      mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+ *      mruby_gemcut_init_worker(mrb);
+ *
+ * 生成された関数は、gem 名の検索や依存関係の解決を行わずに、各 gem の初期化関数を順番に直接呼び出します。
+ * 保護区間は全体でひとつだけです。
+ * フックや予算が設定されている場合、統計情報やメモリの報告を有効にしてビルドした場合は、+mruby_gemcut_require_profile()+ と同じ動作となります。
+ * プロファイルの gem が一部でも初期化済みであれば、+mruby_gemcut_require_profile()+ と同じ動作となります。
+ *
+ * 戻り値と例外の扱いは +mruby_gemcut_require_profile()+ と同じです。
+ */
+#define MRUBY_GEMCUT_DECLARE_PROFILE_INIT(NAME) \
+  MRB_API mrb_value mruby_gemcut_init_ ## NAME(mrb_state *mrb)
+
+/**
+ * +defer+ が真であれば、以後の +mruby_gemcut_require()+ 系の関数や +Gemcut.require+ が gem を初期化する間は GC を止め、
+ * 初期化が終わってから一度だけ GC を行うようにします。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は制御を関数の呼び出し元に戻します。
+ */
+MRB_API void mruby_gemcut_defer_gc(mrb_state *mrb, mrb_bool defer);
+
+enum mruby_gemcut_hook_event
+{
+  MRUBY_GEMCUT_HOOK_INIT = 0,  /* gem_init */
+  MRUBY_GEMCUT_HOOK_FINAL = 1, /* gem_final */
+};
+
+/*
+ * +id+ は gem の番号で、+name+ は gem 名です。
+ * +ok+ は after の場合に、gem_init や gem_final が例外を発生させずに戻れば真となります。before の場合は常に真です。
+ */
+typedef void mruby_gemcut_hook_f(mrb_state *mrb, enum mruby_gemcut_hook_event event, int id, const char *name, mrb_bool ok, void *ud);
+
+/**
+ * gemcut が gem_init と gem_final を呼び出す前後で、+before+ と +after+ を呼び出すようにします。
+ * どちらも +NULL+ であればフックを取り除きます。
+ *
+ * フックが設定されている間は gem ごとに保護区間を設けるため、例外が発生した場合も after が呼び出されます。
+ * また、+mruby_gemcut_init_<profile>()+ も gem ごとに初期化する通常の方法となります。
+ * 設定されていなければ、gem ごとの分岐がひとつ増えるだけです。
+ *
+ * フックの中で例外を発生させてはいけません。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は制御を関数の呼び出し元に戻します。
+ */
+MRB_API void mruby_gemcut_set_hooks(mrb_state *mrb, mruby_gemcut_hook_f *before, mruby_gemcut_hook_f *after, void *ud);
+
+/**
+ * +Module#const_missing+ と +Object#method_missing+ を差し替えて、
+ * 未初期化の gem が定義するトップレベルの定数や +Kernel+ のメソッドが最初に参照された時点で、その gem を初期化するようにします。
+ *
+ * 定数名・メソッド名と gem の対応はビルド時に gem のソースコードから拾い出したものです。
+ * ブラックリストに含まれる gem は初期化されません。
+ * また +mruby_gemcut_lock()+ した後は何も初期化しません。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_autoload(mrb_state *mrb);
+
 /**
  * +src+ で有効化されている gems を +dest+ でも利用可能なように写します。
  * すでに初期化されている gems はそのまま利用可能です。
@@ -38,11 +124,86 @@ MRB_API mrb_value mruby_gemcut_require(mrb_state *mrb, const char *name);
  */
 MRB_API mrb_value mruby_gemcut_imitate_to(mrb_state *dest, mrb_state *src);
 
+/**
+ * +src+ で有効化されている gems を、+num+ 個の +dests+ それぞれで利用可能なように写します。
+ * 写す gems は呼び出し時点の +src+ の状態で一度だけ求められます。
+ *
+ * 失敗した mrb_state の数を返します。
+ * 失敗した mrb_state の +exc+ には発生した例外オブジェクトが設定されます。
+ *
+ * この関数は例外を発生させません。
+ */
+MRB_API int mruby_gemcut_imitate_to_many(mrb_state *dests[], size_t num, mrb_state *src);
+
+/**
+ * +mruby_gemcut_fingerprint()+ で得たフィンガープリントが表す gems を、ひとつの保護区間の中でまとめて初期化します。
+ * すでに初期化されている gems はそのまま残ります。
+ *
+ * gems の組み合わせを別のプロセスへ持ち運ぶ場合は、フィンガープリントを保存しておき、この関数で作り直します。
+ *
+ * 戻り値は +mruby_gemcut_require()+ と同じです。
+ * 別のビルドで得たフィンガープリントや、形式が正しくないフィンガープリントであれば +ArgumentError+ となります。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_apply_fingerprint(mrb_state *mrb, const char *fp);
+
+/**
+ * 現在初期化されている gems と、クラス・モジュールの状態 (継承関係・メソッド・定数) を記録します。
+ * すでに記録していた場合は置き換えます。
+ *
+ * 記録されるのは +Object+ から定数をたどって到達できるクラス・モジュールと、その特異クラスです。
+ * グローバル変数やクラス変数、個々のオブジェクトの状態は記録されません。
+ *
+ * mruby-2.1 より前では +NotImplementedError+ となります。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_checkpoint(mrb_state *mrb);
+
+/**
+ * +mruby_gemcut_checkpoint()+ 以降に初期化された gems の +gem_final+ を初期化と逆の順に呼び出し、
+ * その後に定義・変更されたクラス・モジュール・定数・メソッドを記録した時点の状態に戻します。
+ *
+ * 記録は残るため、何度でも同じ状態に戻せます。
+ * +mrb_close()+ と +mrb_open()+ をやり直すことなく mrb_state を使い回すためのものですが、
+ * グローバル変数など記録されない状態は元に戻らないことに注意して下さい。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_rollback(mrb_state *mrb);
+
+/**
+ * +mruby_gemcut_require()+ と同じく +name+ の gem を依存関係とともに初期化しますが、
+ * 途中で例外が発生するか予算を超えた場合は、この呼び出しで初期化した全ての gems を巻き戻します。
+ * 巻き戻しは +mruby_gemcut_rollback()+ と同じ方法で行い、+mruby_gemcut_checkpoint()+ の記録には影響しません。
+ *
+ * +max_ns+ は全体に掛けてよい時間 (ナノ秒) で、gem ごとの初期化が終わるたびに確かめます。
+ * gem の初期化そのものを途中で止めることはできないため、最後の gem の分だけ超える場合があります。
+ * +max_bytes+ はこの呼び出しの間に確保されて生存しているメモリの量 (バイト) で、超える要求は断られて +NoMemoryError+ となります。
+ * 解放された分は差し引かれますが、呼び出しの前に確保されていたメモリを拡張した場合は拡張後の大きさ全体を数えます。
+ * どちらも 0 であれば制限しません。
+ *
+ * 巻き戻しに備えて、呼び出しのたびにクラスツリー全体の記録を取ります。
+ * 定義されているクラスやメソッドが多いほど、gem の初期化とは別にその分の時間とメモリが掛かります。
+ *
+ * 失敗した場合は、失敗した gem の名前と理由を含む +LoadError+ 例外オブジェクトを返します。
+ * 初期化に失敗した gem の +gem_final+ は呼び出されません。
+ *
+ * mruby-2.1 より前では +NotImplementedError+ となります。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_require_with_budget(mrb_state *mrb, const char *name, uint64_t max_ns, size_t max_bytes);
+
 /* 状態取得 API */
 
 /**
  * +Gemcut.require+ して有効となった gem 名の配列を返します。
  *
+ * 配列は凍結されており、gem が追加されるまでは同じオブジェクトを返します。
+ * 並べ替えなどを行う場合は複製して下さい。
+ *
  * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は +nil+ を返します。
  */
 MRB_API mrb_value mruby_gemcut_loaded_features(mrb_state *mrb);
@@ -82,6 +243,257 @@ MRB_API int mruby_gemcut_loadable_count(mrb_state *mrb);
  */
 MRB_API mrb_bool mruby_gemcut_loadable_p(mrb_state *mrb, const char *name);
 
+/**
+ * 引数 +name+ に一致する gem が直接依存する gem 名の配列を返します。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_dependencies(mrb_state *mrb, const char *name);
+
+/**
+ * 引数 +name+ に一致する gem に直接依存している gem 名の配列を返します。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_dependents(mrb_state *mrb, const char *name);
+
+/**
+ * 引数 +name+ に一致する gem を +Gemcut.require+ した場合に初期化される gem 名の配列を、初期化される順に返します。
+ * +exclude_loaded+ が真であれば、すでに初期化されている gem を除きます。
+ *
+ * この関数は例外を発生させる場合がありますが、<tt>mrb->jmp == NULL</tt> の場合は発生した例外オブジェクトを返します。
+ */
+MRB_API mrb_value mruby_gemcut_closure(mrb_state *mrb, const char *name, mrb_bool exclude_loaded);
+
+/**
+ * 初期化されている gems の組み合わせを表す文字列 (フィンガープリント) を +buf+ に書き込みます。
+ *
+ * フィンガープリントは <tt>"d269c0cf-81"</tt> のような ASCII 文字列で、先頭の 8 桁は +mgems_list+ から求めたビルドの識別子です。
+ * 同じビルドで同じ組み合わせであれば、初期化した順序に関わらず同じ文字列となるため、そのまま比較したり辞書のキーにしたりできます。
+ *
+ * 戻り値は終端の NUL 文字を除いた長さです。
+ * +size+ が足りない場合は切り詰めますが、戻り値は切り詰める前の長さとなります (+snprintf()+ と同じ)。
+ * メモリは確保しません。
+ * 失敗した場合は 0 を返します。
+ */
+MRB_API size_t mruby_gemcut_fingerprint(mrb_state *mrb, char buf[], size_t size);
+
+/* プール API */
+
+struct mruby_gemcut_pool;
+
+struct mruby_gemcut_pool_stats
+{
+  uint64_t hits;            /* 待機していた mrb_state を渡した回数 */
+  uint64_t misses;          /* 待機している mrb_state が無く、その場で構築した回数 */
+  uint64_t refills;         /* 補充のために構築した mrb_state の数 */
+  uint64_t failures;        /* 補充のための構築に失敗した回数 */
+  uint64_t refill_ns_total; /* 補充のための構築に掛かった時間の合計 (ナノ秒) */
+  uint64_t refill_ns_max;   /* 補充のための構築に掛かった時間の最大値 (ナノ秒) */
+  uint64_t recycles;        /* 返却された mrb_state を巻き戻して待機させた回数 */
+  int idle;                 /* 現在待機している mrb_state の数 */
+};
+
+/**
+ * +profile+ の gem を初期化済みの mrb_state を待機させておくプールを作成します。
+ * +profile+ が +NULL+ であれば、gem を初期化していない mrb_state を待機させます。
+ *
+ * 待機数が +min+ を下回ると、補充スレッドが +max+ に達するまで mrb_state を構築します。
+ * 補充スレッドから +allocf+ が呼ばれるため、+allocf+ はスレッド安全でなければなりません。
+ *
+ * 失敗した場合は +NULL+ を返します。
+ */
+MRB_API struct mruby_gemcut_pool *mruby_gemcut_pool_new(mrb_allocf allocf, void *ud, const char *profile, int min, int max);
+
+/**
+ * 待機している mrb_state を取り出します。
+ * 待機しているものが無い場合は、その場で構築して返します。
+ *
+ * 失敗した場合は +NULL+ を返します。
+ */
+MRB_API mrb_state *mruby_gemcut_pool_checkout(struct mruby_gemcut_pool *pool);
+
+/**
+ * +mruby_gemcut_pool_checkout()+ で取り出した mrb_state を返却します。
+ *
+ * 待機数が +max+ に達していなければ、+mruby_gemcut_rollback()+ で構築直後の状態に戻して再び待機させます。
+ * 巻き戻せない場合は破棄します。
+ */
+MRB_API void mruby_gemcut_pool_checkin(struct mruby_gemcut_pool *pool, mrb_state *mrb);
+
+/**
+ * プールの統計情報を +stats+ に格納します。
+ */
+MRB_API void mruby_gemcut_pool_stats(struct mruby_gemcut_pool *pool, struct mruby_gemcut_pool_stats *stats);
+
+/**
+ * 補充スレッドを停止し、待機している mrb_state を含めてプールを破棄します。
+ */
+MRB_API void mruby_gemcut_pool_free(struct mruby_gemcut_pool *pool);
+
+/* ファクトリ API */
+
+struct mruby_gemcut_factory
+{
+  const char *profile;      /* 初期化するプロファイル。NULL であれば gem を初期化しない */
+  int threads;              /* 構築に使うスレッドの数 (呼び出し元のスレッドを含む) */
+  mrb_allocf allocf;        /* NULL であれば mrb_default_allocf */
+  void *const *allocf_uds;  /* スレッドごとの allocf の ud (threads 個)。NULL であれば全て NULL */
+
+  /*
+   * 構築した mrb_state を、構築したスレッドの上で受け取る。
+   * 構築に失敗した場合 mrb は NULL となる。
+   * NULL であれば構築した mrb_state はその場で破棄する。
+   */
+  void (*func)(mrb_state *mrb, int index, int thread, void *opaque);
+  void *opaque;
+};
+
+/**
+ * +factory+ の設定に従って +num+ 個の mrb_state を +factory->threads+ 個のスレッドで並行して構築します。
+ * 番号 +index+ の mrb_state はスレッド <tt>index % threads</tt> で構築され、そのスレッドの ud を使います。
+ * 構築した mrb_state の所有権は +factory->func+ に移ります。
+ *
+ * 全ての構築が終わるまで戻りません。
+ * 構築に失敗した数を返します。引数が不正な場合は +-1+ を返します。
+ */
+MRB_API int mruby_gemcut_factory_run(const struct mruby_gemcut_factory *factory, int num);
+
+/* フォークサーバ API */
+
+struct mruby_gemcut_forkserver
+{
+  const char *profile;      /* テンプレートに初期化するプロファイル。NULL であれば gem を初期化しない */
+  const char *path;         /* 要求を待ち受ける UNIX ドメインソケットのパス */
+  mrb_allocf allocf;        /* NULL であれば mrb_default_allocf */
+  void *ud;
+  mrb_bool generational;    /* 可能であればテンプレートを世代別 GC に切り替える */
+
+  /*
+   * fork した子プロセスの中で、テンプレートを受け継いだ mrb_state を受け取る。
+   * fd は要求元と繋がったソケットで、子プロセスのプロセス ID を書き込んだ後の状態となっている。
+   * 戻ると子プロセスは mrb_close() を呼ばずに終了する。
+   */
+  void (*worker)(mrb_state *mrb, int fd, void *opaque);
+  void *opaque;
+};
+
+/**
+ * +server->profile+ の gem を初期化した mrb_state をテンプレートとして一度だけ構築し、
+ * +server->path+ の UNIX ドメインソケットで要求を待ち受けます。
+ *
+ * 要求は 1 行で送ります。
+ * <tt>fork</tt> を受け取ると fork(2) した子プロセスで +server->worker+ を呼び、
+ * <tt>quit</tt> を受け取ると待ち受けを終えて、全ての子プロセスが終了するまで待ちます。
+ * そのため、+server->worker+ が終わらない子プロセスが残っていると、この関数は戻りません。
+ *
+ * 要求の 1 行は接続から 1 秒以内に送り終えなければ切断されます。
+ * 終了した子プロセスは待ち受けの合間にも回収されます。
+ *
+ * テンプレートは待ち受けの前に完全な GC を行い、子プロセスと書き込み時複製でページを共有します。
+ *
+ * 作成した子プロセスの数を返します。
+ * テンプレートの構築や待ち受けに失敗した場合、fork(2) が使えない環境では +-1+ を返します。
+ */
+MRB_API int mruby_gemcut_forkserver_run(const struct mruby_gemcut_forkserver *server);
+
+struct mruby_gemcut_smaps
+{
+  uint64_t rss;             /* 以下、全てバイト単位 */
+  uint64_t pss;
+  uint64_t shared_clean;
+  uint64_t shared_dirty;
+  uint64_t private_clean;
+  uint64_t private_dirty;
+};
+
+/**
+ * プロセス +pid+ のメモリの使用量を <tt>/proc/<pid>/smaps_rollup</tt> (無ければ <tt>/proc/<pid>/smaps</tt>) から読み取り、+smaps+ に格納します。
+ * フォークサーバの子プロセスがテンプレートとどれだけページを共有しているかを調べるために使います。
+ *
+ * 成功した場合は +0+ を、読み取れなかった場合 (Linux 以外を含む) は +-1+ を返します。
+ */
+MRB_API int mruby_gemcut_smaps(long pid, struct mruby_gemcut_smaps *smaps);
+
+/* 統計 API */
+
+struct mruby_gemcut_stat
+{
+  const char *name;     /* gem 名 */
+  uint64_t init_ns;     /* gem_init に掛かった時間 (ナノ秒) */
+  uint64_t alloc_calls; /* gem_init の間にメモリを確保した回数 */
+  uint64_t alloc_bytes; /* gem_init の間に確保したメモリの合計 (バイト) */
+  int64_t objects;      /* gem_init の前後で増えた生存オブジェクトの数 */
+};
+
+/**
+ * +Gemcut+ が初期化した gem ごとの統計情報を、初期化した順に並べた配列として返します。
+ * 要素数は +num+ に格納されます。
+ * 配列は +mrb+ が管理しているため、呼び出し側で解放してはいけません。
+ *
+ * gem_init の中から require された gem は、呼び出し元の gem に含めて数えます。
+ * +mruby_gemcut_rollback()+ などで巻き戻された gem の記録は取り除かれます。
+ *
+ * 統計情報は、<tt>build_config.rb</tt> で +enable_stats+ した場合にのみ記録されます。
+ * それ以外の場合は +NULL+ を返します。
+ */
+MRB_API const struct mruby_gemcut_stat *mruby_gemcut_stats(mrb_state *mrb, int *num);
+
+struct mruby_gemcut_memory
+{
+  const char *name; /* gem 名 */
+  size_t bytes;     /* gem_init の間に確保され、現在も解放されていないメモリの量 (バイト) */
+  int64_t objects;  /* gem_init の前後の完全 GC で比べた生存オブジェクトの増分 */
+};
+
+/**
+ * 初期化済みの gem ごとに、現在も残っているメモリの量を +report+ に格納します。
+ * +report+ には最大で +capa+ 個まで格納し、戻り値として全体の個数を返します。
+ * 失敗した場合は -1 を返します。
+ *
+ * 集計の前に完全 GC を行います。
+ * オブジェクトのヒープページは、ページの確保を引き起こした gem に帰属します。
+ *
+ * この情報は、<tt>build_config.rb</tt> で +enable_memory_report+ した場合にのみ記録されます。
+ * それ以外の場合は 0 を返します。
+ */
+MRB_API int mruby_gemcut_memory_report(mrb_state *mrb, struct mruby_gemcut_memory report[], int capa);
+
+struct mruby_gemcut_mrblib_loads
+{
+  uint64_t loads;   /* Ruby で書かれた部分 (mrblib) を持つ gem を初期化した回数 */
+  uint64_t reloads; /* そのうち、同じ gem をプロセス内ですでに初期化していた回数 */
+};
+
+/**
+ * プロセス全体で mrblib を持つ gem を初期化した回数を +loads+ に格納します。
+ *
+ * mrblib の命令列とリテラルは静的な読み込み専用のデータから直接参照されるため、
+ * +reloads+ の分の mrb_state でも複製されずに共有されています。
+ *
+ * この関数は例外を発生させません。
+ */
+MRB_API void mruby_gemcut_mrblib_loads(struct mruby_gemcut_mrblib_loads *loads);
+
+struct mruby_gemcut_cost
+{
+  int gems;         /* 新たに初期化される gem の数 */
+  uint64_t init_ns; /* gem_init に掛かる時間の見積もり (ナノ秒) */
+  uint64_t objects; /* gem_init で増える生存オブジェクトの数の見積もり */
+  uint64_t bytes;   /* gem_init の間に確保されるメモリの量の見積もり (バイト) */
+};
+
+/**
+ * +names+ に含まれる gem を require した場合に新たに初期化される gem と、その費用の見積もりを +cost+ に格納します。
+ * 見積もりは、ビルド時に <tt>rake gemcut:probe</tt> で gem ごとに計測した中央値を足し合わせたものです。
+ * 初期化済みの gem は含めません。
+ *
+ * 計測値が埋め込まれたビルドであれば +true+ を、そうでなければ +false+ を返します (+gems+ 以外は 0 となります)。
+ * 存在しない gem やブラックリストに含まれる gem があれば例外オブジェクトを返します。
+ * いずれの場合も gem は初期化しません。
+ */
+MRB_API mrb_value mruby_gemcut_estimated_cost(mrb_state *mrb, const char *const names[], size_t num, struct mruby_gemcut_cost *cost);
+
 /* mruby モジュール API */
 
 /**
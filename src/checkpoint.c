@@ -0,0 +1,408 @@
+#include "internals.h"
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef GEMCUT_HAVE_VMSNAP
+
+/*
+ * mruby_gemcut_checkpoint() の時点のクラス・モジュールの状態を記録し、mruby_gemcut_rollback() で書き戻す。
+ *
+ * 記録するのは Object から定数をたどって到達できるクラス・モジュールと、その特異クラスについて、
+ * - スーパークラス (include されたモジュールの iclass を含む) と特異クラスへのポインタ
+ * - メソッド表の内容
+ * - 定数 (英大文字で始まるインスタンス変数)
+ * である。
+ * グローバル変数やクラス変数、オブジェクトのインスタンス変数は記録しない。
+ *
+ * 記録したクラスや定数の値、メソッドの Proc は keeper 配列に入れて GC から保護する。
+ */
+
+struct vmsnap_method
+{
+  mrb_sym name;
+  mrb_method_t method;
+};
+
+struct vmsnap_const
+{
+  mrb_sym name;
+  mrb_value value;
+};
+
+struct vmsnap_class
+{
+  struct RClass *klass;
+  struct RClass *super;
+  struct RClass *meta;
+  int nmethods;
+  int nconsts;
+  struct vmsnap_method *methods; /* name の昇順 */
+  struct vmsnap_const *consts;   /* name の昇順 */
+};
+
+struct gemcut_vmsnap
+{
+  int num;
+  int capa;
+  struct vmsnap_class *classes;
+  mrb_value keeper;
+
+  /*
+   * 記録済みのクラスを引くための、ポインタをキーとするオープンアドレス法 (線形探索) の表。
+   * 要素は classes の番号に 1 を足したもので、空き要素は 0。記録を終えたら解放する。
+   */
+  size_t indexcapa; /* 2 のべき乗 */
+  int *index;
+};
+
+struct vmsnap_methods
+{
+  int num;
+  int capa;
+  struct vmsnap_method *list;
+};
+
+struct vmsnap_consts
+{
+  int num;
+  int capa;
+  struct vmsnap_const *list;
+};
+
+static int
+vmsnap_method_cmp(const void *a, const void *b)
+{
+  mrb_sym x = ((const struct vmsnap_method *)a)->name;
+  mrb_sym y = ((const struct vmsnap_method *)b)->name;
+  return (x > y) - (x < y);
+}
+
+static int
+vmsnap_const_cmp(const void *a, const void *b)
+{
+  mrb_sym x = ((const struct vmsnap_const *)a)->name;
+  mrb_sym y = ((const struct vmsnap_const *)b)->name;
+  return (x > y) - (x < y);
+}
+
+static int
+vmsnap_collect_method(mrb_state *mrb, mrb_sym name, mrb_method_t method, void *opaque)
+{
+  struct vmsnap_methods *p = (struct vmsnap_methods *)opaque;
+  if (p->num >= p->capa) {
+    p->capa = p->capa ? p->capa * 2 : 16;
+    p->list = (struct vmsnap_method *)mrb_realloc(mrb, p->list, sizeof(struct vmsnap_method) * p->capa);
+  }
+
+  p->list[p->num].name = name;
+  p->list[p->num].method = method;
+  p->num++;
+
+  return 0;
+}
+
+static int
+vmsnap_collect_const(mrb_state *mrb, mrb_sym name, mrb_value value, void *opaque)
+{
+  const char *s = mrb_sym_name(mrb, name);
+  if (s == NULL || s[0] < 'A' || s[0] > 'Z') {
+    return 0; /* クラスのインスタンス変数や内部で使われる変数 */
+  }
+
+  struct vmsnap_consts *p = (struct vmsnap_consts *)opaque;
+  if (p->num >= p->capa) {
+    p->capa = p->capa ? p->capa * 2 : 16;
+    p->list = (struct vmsnap_const *)mrb_realloc(mrb, p->list, sizeof(struct vmsnap_const) * p->capa);
+  }
+
+  p->list[p->num].name = name;
+  p->list[p->num].value = value;
+  p->num++;
+
+  return 0;
+}
+
+/*
+ * 呼び出し元で list->list を解放しなければならない。
+ */
+static void
+vmsnap_methods_of(mrb_state *mrb, struct RClass *klass, struct vmsnap_methods *list)
+{
+  list->num = list->capa = 0;
+  list->list = NULL;
+  mrb_mt_foreach(mrb, klass, vmsnap_collect_method, list);
+  if (list->num > 1) {
+    qsort(list->list, list->num, sizeof(list->list[0]), vmsnap_method_cmp);
+  }
+}
+
+static void
+vmsnap_consts_of(mrb_state *mrb, struct RClass *klass, struct vmsnap_consts *list)
+{
+  list->num = list->capa = 0;
+  list->list = NULL;
+  mrb_iv_foreach(mrb, mrb_obj_value(klass), vmsnap_collect_const, list);
+  if (list->num > 1) {
+    qsort(list->list, list->num, sizeof(list->list[0]), vmsnap_const_cmp);
+  }
+}
+
+static void
+vmsnap_keep(mrb_state *mrb, struct gemcut_vmsnap *snap, struct RClass *klass)
+{
+  if (klass) {
+    mrb_ary_push(mrb, snap->keeper, mrb_obj_value(klass));
+  }
+}
+
+static size_t
+vmsnap_slot(const struct gemcut_vmsnap *snap, const struct RClass *klass)
+{
+  uintptr_t n = (uintptr_t)klass >> 4;
+  return (size_t)((n * 0x9e3779b97f4a7c15ULL) >> 32) & (snap->indexcapa - 1);
+}
+
+/*
+ * klass が記録済みであれば true を返す。
+ * 記録されていなければ、klass を置くべき空き要素の位置を *slot に格納して false を返す。
+ */
+static bool
+vmsnap_lookup(const struct gemcut_vmsnap *snap, const struct RClass *klass, size_t *slot)
+{
+  size_t mask = snap->indexcapa - 1;
+  for (size_t i = vmsnap_slot(snap, klass);; i = (i + 1) & mask) {
+    int n = snap->index[i];
+    if (n == 0) {
+      *slot = i;
+      return false;
+    }
+
+    if (snap->classes[n - 1].klass == klass) {
+      return true;
+    }
+  }
+}
+
+static void
+vmsnap_index_grow(mrb_state *mrb, struct gemcut_vmsnap *snap)
+{
+  size_t capa = snap->indexcapa ? snap->indexcapa * 2 : 128;
+  mrb_free(mrb, snap->index);
+  snap->index = NULL;
+  snap->indexcapa = 0;
+  snap->index = (int *)mrb_calloc(mrb, capa, sizeof(int));
+  snap->indexcapa = capa;
+
+  for (int n = 0; n < snap->num; n++) {
+    size_t slot;
+    vmsnap_lookup(snap, snap->classes[n].klass, &slot);
+    snap->index[slot] = n + 1;
+  }
+}
+
+/*
+ * klass が記録済みでなければ記録する。
+ */
+static void
+vmsnap_add(mrb_state *mrb, struct gemcut_vmsnap *snap, struct RClass *klass)
+{
+  if (klass == NULL) {
+    return;
+  }
+
+  if ((size_t)(snap->num + 1) * 2 > snap->indexcapa) {
+    vmsnap_index_grow(mrb, snap);
+  }
+
+  size_t slot;
+  if (vmsnap_lookup(snap, klass, &slot)) {
+    return;
+  }
+
+  if (snap->num >= snap->capa) {
+    int capa = snap->capa ? snap->capa * 2 : 64;
+    snap->classes = (struct vmsnap_class *)mrb_realloc(mrb, snap->classes, sizeof(struct vmsnap_class) * capa);
+    snap->capa = capa;
+  }
+
+  struct vmsnap_class *e = &snap->classes[snap->num++];
+  memset(e, 0, sizeof(*e));
+  e->klass = klass;
+  e->super = klass->super;
+  e->meta = klass->c;
+  snap->index[slot] = snap->num;
+
+  vmsnap_keep(mrb, snap, klass);
+  vmsnap_keep(mrb, snap, e->super);
+  vmsnap_keep(mrb, snap, e->meta);
+}
+
+/*
+ * 記録済みのクラスを先頭から順に調べ、定数から到達できるクラス・モジュールを末尾に追加していく (幅優先探索)。
+ */
+static void
+vmsnap_fill(mrb_state *mrb, struct gemcut_vmsnap *snap, struct vmsnap_class *e)
+{
+  int ai = mrb_gc_arena_save(mrb);
+
+  struct vmsnap_methods methods;
+  vmsnap_methods_of(mrb, e->klass, &methods);
+  e->methods = methods.list;
+  e->nmethods = methods.num;
+  for (int i = 0; i < methods.num; i++) {
+    if (MRB_METHOD_PROC_P(methods.list[i].method) && MRB_METHOD_PROC(methods.list[i].method)) {
+      mrb_ary_push(mrb, snap->keeper, mrb_obj_value(MRB_METHOD_PROC(methods.list[i].method)));
+    }
+  }
+
+  struct vmsnap_consts consts;
+  vmsnap_consts_of(mrb, e->klass, &consts);
+  e->consts = consts.list;
+  e->nconsts = consts.num;
+
+  /* vmsnap_add() によって snap->classes が再確保される場合があるため、e はこれ以降使わない */
+  struct RClass *meta = e->meta;
+  for (int i = 0; i < consts.num; i++) {
+    mrb_value v = consts.list[i].value;
+    mrb_ary_push(mrb, snap->keeper, v);
+    if (mrb_type(v) == MRB_TT_CLASS || mrb_type(v) == MRB_TT_MODULE) {
+      vmsnap_add(mrb, snap, mrb_class_ptr(v));
+    }
+  }
+
+  if (meta && meta->tt == MRB_TT_SCLASS) {
+    vmsnap_add(mrb, snap, meta);
+  }
+
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+struct gemcut_vmsnap *
+gemcut_vmsnap_new(mrb_state *mrb, mrb_value keeper)
+{
+  struct gemcut_vmsnap *snap = (struct gemcut_vmsnap *)mrb_calloc(mrb, 1, sizeof(struct gemcut_vmsnap));
+  snap->keeper = keeper;
+  return snap;
+}
+
+void
+gemcut_vmsnap_take(mrb_state *mrb, struct gemcut_vmsnap *snap)
+{
+  vmsnap_add(mrb, snap, mrb->object_class);
+  if (mrb->top_self) {
+    struct RClass *mainclass = mrb_basic_ptr(mrb_obj_value(mrb->top_self))->c;
+    vmsnap_add(mrb, snap, (mainclass->tt == MRB_TT_SCLASS) ? mainclass : NULL);
+  }
+
+  for (int i = 0; i < snap->num; i++) {
+    vmsnap_fill(mrb, snap, &snap->classes[i]);
+  }
+
+  mrb_free(mrb, snap->index);
+  snap->index = NULL;
+  snap->indexcapa = 0;
+}
+
+static void
+vmsnap_restore_methods(mrb_state *mrb, const struct vmsnap_class *e)
+{
+  struct vmsnap_methods now;
+  vmsnap_methods_of(mrb, e->klass, &now);
+
+  int i = 0, j = 0;
+  while (i < e->nmethods || j < now.num) {
+    const struct vmsnap_method *old = (i < e->nmethods) ? &e->methods[i] : NULL;
+    const struct vmsnap_method *cur = (j < now.num) ? &now.list[j] : NULL;
+
+    if (cur == NULL || (old && old->name < cur->name)) {
+      mrb_define_method_raw(mrb, e->klass, old->name, old->method);
+      i++;
+    } else if (old == NULL || cur->name < old->name) {
+      mrb_remove_method(mrb, e->klass, cur->name);
+      j++;
+    } else {
+      if (memcmp(&old->method, &cur->method, sizeof(mrb_method_t)) != 0) {
+        mrb_define_method_raw(mrb, e->klass, old->name, old->method);
+      }
+      i++;
+      j++;
+    }
+  }
+
+  mrb_free(mrb, now.list);
+}
+
+static void
+vmsnap_restore_consts(mrb_state *mrb, const struct vmsnap_class *e)
+{
+  struct vmsnap_consts now;
+  vmsnap_consts_of(mrb, e->klass, &now);
+
+  mrb_value self = mrb_obj_value(e->klass);
+  int i = 0, j = 0;
+  while (i < e->nconsts || j < now.num) {
+    const struct vmsnap_const *old = (i < e->nconsts) ? &e->consts[i] : NULL;
+    const struct vmsnap_const *cur = (j < now.num) ? &now.list[j] : NULL;
+
+    if (cur == NULL || (old && old->name < cur->name)) {
+      mrb_const_set(mrb, self, old->name, old->value);
+      i++;
+    } else if (old == NULL || cur->name < old->name) {
+      mrb_const_remove(mrb, self, cur->name);
+      j++;
+    } else {
+      if (!mrb_obj_equal(mrb, old->value, cur->value)) {
+        mrb_const_set(mrb, self, old->name, old->value);
+      }
+      i++;
+      j++;
+    }
+  }
+
+  mrb_free(mrb, now.list);
+}
+
+void
+gemcut_vmsnap_restore(mrb_state *mrb, const struct gemcut_vmsnap *snap)
+{
+  int ai = mrb_gc_arena_save(mrb);
+
+  /* 先に継承関係を戻してから、メソッドと定数を戻す */
+  for (int i = 0; i < snap->num; i++) {
+    const struct vmsnap_class *e = &snap->classes[i];
+    e->klass->super = e->super;
+    e->klass->c = e->meta;
+  }
+
+  for (int i = 0; i < snap->num; i++) {
+    const struct vmsnap_class *e = &snap->classes[i];
+    vmsnap_restore_methods(mrb, e);
+    vmsnap_restore_consts(mrb, e);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+#if AUX_MRUBY_RELEASE_NO >= 30000 ? !defined(MRB_NO_METHOD_CACHE) : defined(MRB_METHOD_CACHE)
+  /* 継承関係が変わった可能性があるため、メソッドキャッシュは全て捨てる */
+  for (int i = 0; i < snap->num; i++) {
+    mrb_mc_clear_by_class(mrb, snap->classes[i].klass);
+  }
+#endif
+}
+
+void
+gemcut_vmsnap_free(mrb_state *mrb, struct gemcut_vmsnap *snap)
+{
+  if (snap == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < snap->num; i++) {
+    mrb_free(mrb, snap->classes[i].methods);
+    mrb_free(mrb, snap->classes[i].consts);
+  }
+  mrb_free(mrb, snap->classes);
+  mrb_free(mrb, snap->index);
+  mrb_free(mrb, snap);
+}
+
+#endif /* GEMCUT_HAVE_VMSNAP */
@@ -13,7 +13,7 @@
 #endif
 
 #if AUX_MRUBY_RELEASE_NO < 20100
-static void
+static inline void
 mrb_obj_freeze(mrb_state *mrb, mrb_value obj)
 {
   (void)mrb;
@@ -35,6 +35,10 @@ mrb_obj_freeze(mrb_state *mrb, mrb_value obj)
 # define AUX_PRIs_MAKE(STR) mrb_str_new_cstr(mrb, (STR))
 #endif
 
+#if AUX_MRUBY_RELEASE_NO < 20100
+# define mrb_sym_name(MRB, SYM) mrb_sym2name(MRB, SYM)
+#endif
+
 #if AUX_MRUBY_RELEASE_NO <= 30000
 # if defined(MRB_NAN_BOXING) || defined(MRB_WORD_BOXING)
 union gemcut_cptr_wrapper
@@ -58,7 +62,7 @@ static_assert(sizeof(mrb_value) >= sizeof(void *), "need MRB_NO_BOXING");
 /*
  * mrb_cptr_value() は NoMemoryError 例外を起こす可能性があるためすり替える
  */
-static mrb_value
+static inline mrb_value
 aux_cptr_value(mrb_state *mrb, void *ptr)
 {
   (void)mrb;
@@ -66,7 +70,7 @@ aux_cptr_value(mrb_state *mrb, void *ptr)
   return payload.val;
 }
 
-static void *
+static inline void *
 aux_cptr(mrb_value val)
 {
   union gemcut_cptr_unwrapper payload = { val };
@@ -85,14 +89,14 @@ struct mrb_protect_error_wrap
   void *opaque;
 };
 
-static mrb_value
+static inline mrb_value
 mrb_protect_error_wrap(mrb_state *mrb, mrb_value val)
 {
   const struct mrb_protect_error_wrap *wrap = (struct mrb_protect_error_wrap *)aux_cptr(val);
   return wrap->body(mrb, wrap->opaque);
 }
 
-static mrb_value
+static inline mrb_value
 mrb_protect_error(mrb_state *mrb, mrb_protect_error_f *body, void *opaque, mrb_bool *error)
 {
   struct mrb_protect_error_wrap wrap = { body, opaque };
@@ -101,7 +105,7 @@ mrb_protect_error(mrb_state *mrb, mrb_protect_error_f *body, void *opaque, mrb_b
 #endif // AUX_MRUBY_RELEASE_NO
 
 #if AUX_MRUBY_RELEASE_NO >= 30100
-static void
+static inline void
 aux_ignite_gem_init(mrb_state *mrb, void (*geminit)(mrb_state *mrb))
 {
   geminit(mrb);
@@ -112,7 +116,7 @@ struct aux_ignite_gem_init_body
   void (*geminit)(mrb_state *);
 };
 
-static mrb_value
+static inline mrb_value
 aux_ignite_gem_init_body(mrb_state *mrb, mrb_value func)
 {
   struct aux_ignite_gem_init_body *p = (struct aux_ignite_gem_init_body *)mrb_cptr(func);
@@ -120,7 +124,7 @@ aux_ignite_gem_init_body(mrb_state *mrb, mrb_value func)
   return mrb_nil_value();
 }
 
-static void
+static inline void
 aux_ignite_gem_init(mrb_state *mrb, void (*geminit)(mrb_state *mrb))
 {
   struct aux_ignite_gem_init_body args = { geminit };
@@ -131,4 +135,21 @@ aux_ignite_gem_init(mrb_state *mrb, void (*geminit)(mrb_state *mrb))
 }
 #endif
 
+/*
+ * 現在の C 関数を呼び出したメソッドやブロックの、定数を探し始めるクラスを返す。
+ */
+static inline struct RClass *
+aux_caller_target_class(mrb_state *mrb)
+{
+  const mrb_callinfo *ci = mrb->c->ci;
+  if (ci <= mrb->c->cibase || ci[-1].proc == NULL) {
+    return NULL;
+  }
+#ifdef MRB_PROC_TARGET_CLASS
+  return MRB_PROC_TARGET_CLASS(ci[-1].proc);
+#else
+  return ci[-1].proc->target_class;
+#endif
+}
+
 #endif // MRUBY_GEMCUT_COMPAT_H
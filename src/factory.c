@@ -0,0 +1,117 @@
+#include "sysdep.h"
+#include "internals.h"
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * 複数のスレッドで並行して mrb_state を構築する。
+ *
+ * 各 mrb_state は互いに独立しており、gemcut がプロセス全体で共有するのは
+ * 読み込み専用の mgems_list などの表と、struct gemcut の解放を知らせる gemcut_epoch (アトミック変数) だけである。
+ * 番号 i の mrb_state はスレッド (i % threads) が構築するため、スレッド間で作業を受け渡す必要はない。
+ */
+
+struct factory_worker
+{
+  const struct mruby_gemcut_factory *factory;
+  int thread;
+  int num;
+  int failures;
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  aux_thread_t handle;
+  bool running;
+#endif
+};
+
+static mrb_state *
+factory_build(const struct mruby_gemcut_factory *factory, int thread)
+{
+  mrb_allocf allocf = factory->allocf ? factory->allocf : mrb_default_allocf;
+  void *ud = factory->allocf_uds ? factory->allocf_uds[thread] : NULL;
+  mrb_state *mrb = mrb_open_core(allocf, ud);
+  if (mrb == NULL) {
+    return NULL;
+  }
+
+  if (factory->profile) {
+    mrb_value ret = mruby_gemcut_require_profile(mrb, factory->profile);
+    if (mrb_exception_p(ret)) {
+      mrb_close(mrb);
+      return NULL;
+    }
+  }
+
+  return mrb;
+}
+
+static void *
+factory_work(void *opaque)
+{
+  struct factory_worker *w = (struct factory_worker *)opaque;
+  const struct mruby_gemcut_factory *factory = w->factory;
+
+  for (int i = w->thread; i < w->num; i += factory->threads) {
+    mrb_state *mrb = factory_build(factory, w->thread);
+    if (mrb == NULL) {
+      w->failures++;
+    }
+
+    if (factory->func) {
+      factory->func(mrb, i, w->thread, factory->opaque);
+    } else if (mrb) {
+      mrb_close(mrb);
+    }
+  }
+
+  return NULL;
+}
+
+MRB_API int
+mruby_gemcut_factory_run(const struct mruby_gemcut_factory *factory, int num)
+{
+  if (factory == NULL || factory->threads < 1 || num < 0) {
+    return -1;
+  }
+
+  int threads = factory->threads;
+  struct factory_worker *workers = (struct factory_worker *)calloc(threads, sizeof(struct factory_worker));
+  if (workers == NULL) {
+    return -1;
+  }
+
+  for (int t = 0; t < threads; t++) {
+    workers[t].factory = factory;
+    workers[t].thread = t;
+    workers[t].num = num;
+  }
+
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  /* スレッド 0 は呼び出し元で動かす。スレッドを作れなかった分も呼び出し元で肩代わりする */
+  for (int t = 1; t < threads; t++) {
+    workers[t].running = aux_thread_create(&workers[t].handle, factory_work, &workers[t]);
+  }
+
+  factory_work(&workers[0]);
+
+  for (int t = 1; t < threads; t++) {
+    if (workers[t].running) {
+      aux_thread_join(workers[t].handle);
+    } else {
+      factory_work(&workers[t]);
+    }
+  }
+#else
+  for (int t = 0; t < threads; t++) {
+    factory_work(&workers[t]);
+  }
+#endif
+
+  int failures = 0;
+  for (int t = 0; t < threads; t++) {
+    failures += workers[t].failures;
+  }
+
+  free(workers);
+
+  return failures;
+}
@@ -0,0 +1,325 @@
+#include "sysdep.h"
+#include "internals.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef MRUBY_GEMCUT_NO_FORK
+# include <errno.h>
+# include <fcntl.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/types.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+/*
+ * テンプレートとなる mrb_state を一度だけ構築し、要求ごとに fork(2) した子プロセスへ受け継がせる。
+ *
+ * 要求は UNIX ドメインソケットに 1 行で送る。
+ *
+ *      fork    子プロセスを作る。子プロセスは自身のプロセス ID を 1 行で返してから worker を呼ぶ
+ *      quit    待ち受けを終える
+ *
+ * 要求を送らずに居座る接続や少しずつ送り続ける接続で待ち受けが止まらないように、
+ * 1 行の読み込み全体に FORKSERVER_TIMEOUT 秒の期限を設ける。
+ * 終了した子プロセスは、要求がなくても FORKSERVER_REAP_INTERVAL 秒ごとに回収する。
+ *
+ * 子プロセスのページはテンプレートと書き込み時複製で共有される。
+ * mruby のヒープは移動できないため、待ち受けの前に完全な GC を行って不要なオブジェクトを解放するだけに留め、
+ * 子プロセスの GC が古いオブジェクトのページに書き込まないように、可能であれば世代別 GC に切り替える。
+ */
+
+#ifndef MRUBY_GEMCUT_NO_FORK
+
+#define FORKSERVER_TIMEOUT 1
+#define FORKSERVER_REAP_INTERVAL 1
+
+static mrb_state *
+forkserver_template(const struct mruby_gemcut_forkserver *server)
+{
+  mrb_state *mrb = mrb_open_core(server->allocf ? server->allocf : mrb_default_allocf, server->ud);
+  if (mrb == NULL) {
+    return NULL;
+  }
+
+  if (server->profile) {
+    mrb_value ret = mruby_gemcut_require_profile(mrb, server->profile);
+    if (mrb_exception_p(ret)) {
+      mrb_close(mrb);
+      return NULL;
+    }
+  }
+
+  mrb->exc = NULL;
+
+  /* GC.generational_mode= は mruby のビルド設定によっては存在しない */
+  if (server->generational) {
+    mrb_value top = mrb_obj_value(mrb->object_class);
+    mrb_sym id_gc = mrb_intern_lit(mrb, "GC");
+    if (mrb_const_defined(mrb, top, id_gc)) {
+      mrb_value mod = mrb_const_get(mrb, top, id_gc);
+      mrb_sym id_mode = mrb_intern_lit(mrb, "generational_mode=");
+      if (mrb_obj_respond_to(mrb, mrb_class(mrb, mod), id_mode)) {
+        mrb_value enable = mrb_true_value();
+        mrb_funcall_argv(mrb, mod, id_mode, 1, &enable);
+      }
+    }
+  }
+
+  mrb_full_gc(mrb);
+  mrb_full_gc(mrb);
+
+  return mrb;
+}
+
+static int
+forkserver_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  /* 待ち受けの合間に子プロセスを回収するため、accept(2) では止まらないようにしておく */
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  return fd;
+}
+
+/*
+ * fd が読み込めるようになるまで、単調時計で deadline (ナノ秒) まで待つ。時間切れや失敗の場合は -1 を返す。
+ */
+static int
+forkserver_wait(int fd, uint64_t deadline)
+{
+  for (;;) {
+    uint64_t now = aux_monotonic_ns();
+    if (now >= deadline) {
+      return -1;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int n = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return (n > 0) ? 0 : -1;
+  }
+}
+
+/*
+ * 改行までの 1 行を読み込む。
+ * 長すぎる行や、改行の前に接続が切れるか deadline を過ぎた場合は -1 を返す。
+ */
+static int
+forkserver_readline(int fd, char buf[], size_t size, uint64_t deadline)
+{
+  size_t len = 0;
+  for (;;) {
+    if (forkserver_wait(fd, deadline) != 0) {
+      return -1;
+    }
+
+    char ch;
+    ssize_t n = read(fd, &ch, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || len + 1 >= size) {
+      return -1;
+    }
+    if (ch == '\n') {
+      buf[len] = '\0';
+      return 0;
+    }
+    buf[len++] = ch;
+  }
+}
+
+static void
+forkserver_reap(mrb_bool wait)
+{
+  int status;
+  while (waitpid(-1, &status, wait ? 0 : WNOHANG) > 0) {
+  }
+}
+
+static void
+forkserver_child(const struct mruby_gemcut_forkserver *server, mrb_state *mrb, int listener, int fd)
+{
+  close(listener);
+
+  char pid[32];
+  int len = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+  if (write(fd, pid, len) == len && server->worker) {
+    server->worker(mrb, fd, server->opaque);
+  }
+
+  /* テンプレートのページに書き込まないよう、mrb_close() は呼ばずに終了する */
+  fflush(NULL);
+  _exit(EXIT_SUCCESS);
+}
+
+MRB_API int
+mruby_gemcut_forkserver_run(const struct mruby_gemcut_forkserver *server)
+{
+  if (server == NULL || server->path == NULL) {
+    return -1;
+  }
+
+  mrb_state *mrb = forkserver_template(server);
+  if (mrb == NULL) {
+    return -1;
+  }
+
+  int listener = forkserver_listen(server->path);
+  if (listener < 0) {
+    mrb_close(mrb);
+    return -1;
+  }
+
+  int forked = 0;
+  for (;;) {
+    forkserver_reap(FALSE);
+
+    struct pollfd pfd;
+    pfd.fd = listener;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ready = poll(&pfd, 1, FORKSERVER_REAP_INTERVAL * 1000);
+    if (ready < 0 && errno != EINTR) {
+      break;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;
+      }
+      break;
+    }
+
+    /* 受け付けたソケットは O_NONBLOCK を受け継ぐ環境があるため、明示的に外しておく */
+    char req[16];
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0 ||
+        forkserver_readline(fd, req, sizeof(req), aux_monotonic_ns() + FORKSERVER_TIMEOUT * 1000000000ULL) != 0) {
+      close(fd);
+      continue;
+    }
+
+    if (strcmp(req, "quit") == 0) {
+      close(fd);
+      break;
+    }
+
+    if (strcmp(req, "fork") == 0) {
+      fflush(NULL);
+      pid_t pid = fork();
+      if (pid == 0) {
+        forkserver_child(server, mrb, listener, fd);
+      } else if (pid > 0) {
+        forked++;
+      }
+    }
+
+    close(fd);
+  }
+
+  close(listener);
+  unlink(server->path);
+  mrb_close(mrb);
+  forkserver_reap(TRUE);
+
+  return forked;
+}
+
+#else
+
+MRB_API int
+mruby_gemcut_forkserver_run(const struct mruby_gemcut_forkserver *server)
+{
+  (void)server;
+
+  return -1;
+}
+
+#endif /* MRUBY_GEMCUT_NO_FORK */
+
+/*
+ * /proc/<pid>/smaps_rollup (無ければ /proc/<pid>/smaps) の各項目を合計する。
+ * Linux 以外ではファイルが開けないため -1 を返す。
+ */
+MRB_API int
+mruby_gemcut_smaps(long pid, struct mruby_gemcut_smaps *smaps)
+{
+  static const struct { const char *key; size_t offset; } fields[] = {
+    { "Rss:", offsetof(struct mruby_gemcut_smaps, rss) },
+    { "Pss:", offsetof(struct mruby_gemcut_smaps, pss) },
+    { "Shared_Clean:", offsetof(struct mruby_gemcut_smaps, shared_clean) },
+    { "Shared_Dirty:", offsetof(struct mruby_gemcut_smaps, shared_dirty) },
+    { "Private_Clean:", offsetof(struct mruby_gemcut_smaps, private_clean) },
+    { "Private_Dirty:", offsetof(struct mruby_gemcut_smaps, private_dirty) },
+  };
+
+  if (smaps == NULL) {
+    return -1;
+  }
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%ld/smaps_rollup", pid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    snprintf(path, sizeof(path), "/proc/%ld/smaps", pid);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+      return -1;
+    }
+  }
+
+  memset(smaps, 0, sizeof(*smaps));
+
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+      size_t len = strlen(fields[i].key);
+      if (strncmp(line, fields[i].key, len) == 0) {
+        /* 単位は常に kB */
+        uint64_t *p = (uint64_t *)((char *)smaps + fields[i].offset);
+        *p += (uint64_t)strtoull(line + len, NULL, 10) * 1024;
+        break;
+      }
+    }
+  }
+
+  fclose(fp);
+
+  return 0;
+}
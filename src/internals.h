@@ -10,7 +10,27 @@
 #include <mruby/value.h>
 #include <mruby/data.h>
 #include <mruby-gemcut.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include "compat.h"
 
+/* src/memtrack.c */
+struct gemcut_memtrack;
+struct gemcut_memtrack *gemcut_memtrack_attach(mrb_state *mrb, int numgems);
+void gemcut_memtrack_detach(mrb_state *mrb, struct gemcut_memtrack *mt);
+int gemcut_memtrack_enter(struct gemcut_memtrack *mt, int owner);
+size_t gemcut_memtrack_bytes(const struct gemcut_memtrack *mt, int owner);
+void gemcut_memtrack_limit(struct gemcut_memtrack *mt, size_t limit);
+bool gemcut_memtrack_exceeded(const struct gemcut_memtrack *mt);
+
+/* src/checkpoint.c */
+#if AUX_MRUBY_RELEASE_NO >= 20100
+# define GEMCUT_HAVE_VMSNAP 1
+struct gemcut_vmsnap;
+struct gemcut_vmsnap *gemcut_vmsnap_new(mrb_state *mrb, mrb_value keeper);
+void gemcut_vmsnap_take(mrb_state *mrb, struct gemcut_vmsnap *snap);
+void gemcut_vmsnap_restore(mrb_state *mrb, const struct gemcut_vmsnap *snap);
+void gemcut_vmsnap_free(mrb_state *mrb, struct gemcut_vmsnap *snap);
+#endif
+
 #endif /* MRUBY_GEMCUT_INTERNALS_H */
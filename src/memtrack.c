@@ -0,0 +1,242 @@
+#include "internals.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(MRUBY_GEMCUT_ENABLE_MEMORY_REPORT) || defined(GEMCUT_HAVE_VMSNAP)
+
+/*
+ * mrb->allocf をすり替えて、gem_init の間に確保されたメモリブロックを gem ごとに追跡する。
+ *
+ * 追跡しているブロックはポインタをキーとするオープンアドレス法 (線形探索) の表で管理し、
+ * 解放されたら確保した gem の使用量から差し引く。
+ * 表そのものは元の allocf で確保するため、追跡の対象にはならない。
+ *
+ * 上限が設定されている場合は、追跡しているブロックの合計が上限を超える確保を断る。
+ */
+
+struct memtrack_entry
+{
+  void *ptr; /* 空き要素であれば NULL */
+  size_t size;
+  int owner;
+};
+
+struct gemcut_memtrack
+{
+  mrb_allocf allocf;
+  void *allocf_ud;
+  int owner; /* 現在初期化中の gem 番号。gem_init の外であれば -1 */
+  int numgems;
+  bool exceeded; /* 上限を超える確保を断った */
+  size_t limit; /* 0 であれば無制限 */
+  size_t total; /* 追跡しているブロックの合計 */
+  size_t *bytes; /* gem ごとの生存しているメモリの量 */
+  size_t capa; /* 2 のべき乗 */
+  size_t count;
+  struct memtrack_entry *table;
+};
+
+static size_t
+memtrack_slot(const struct gemcut_memtrack *mt, const void *ptr)
+{
+  uintptr_t n = (uintptr_t)ptr >> 4;
+  return (size_t)((n * 0x9e3779b97f4a7c15ULL) >> 32) & (mt->capa - 1);
+}
+
+static void
+memtrack_place(struct gemcut_memtrack *mt, const struct memtrack_entry *e)
+{
+  size_t i = memtrack_slot(mt, e->ptr);
+  while (mt->table[i].ptr) {
+    i = (i + 1) & (mt->capa - 1);
+  }
+
+  mt->table[i] = *e;
+  mt->count++;
+}
+
+static bool
+memtrack_grow(mrb_state *mrb, struct gemcut_memtrack *mt)
+{
+  size_t oldcapa = mt->capa;
+  struct memtrack_entry *old = mt->table;
+  size_t capa = oldcapa * 2;
+  struct memtrack_entry *table = (struct memtrack_entry *)mt->allocf(mrb, NULL, sizeof(struct memtrack_entry) * capa, mt->allocf_ud);
+  if (table == NULL) {
+    return false;
+  }
+
+  memset(table, 0, sizeof(struct memtrack_entry) * capa);
+  mt->table = table;
+  mt->capa = capa;
+  mt->count = 0;
+
+  for (size_t i = 0; i < oldcapa; i++) {
+    if (old[i].ptr) {
+      memtrack_place(mt, &old[i]);
+    }
+  }
+
+  mt->allocf(mrb, old, 0, mt->allocf_ud);
+  return true;
+}
+
+static void
+memtrack_insert(mrb_state *mrb, struct gemcut_memtrack *mt, void *ptr, size_t size, int owner)
+{
+  if ((mt->count + 1) * 2 > mt->capa && !memtrack_grow(mrb, mt)) {
+    return; /* 追跡できなくなるだけ */
+  }
+
+  struct memtrack_entry e = { ptr, size, owner };
+  memtrack_place(mt, &e);
+  mt->bytes[owner] += size;
+  mt->total += size;
+}
+
+/*
+ * ptr を追跡していれば取り除いて true を返す
+ */
+static bool
+memtrack_remove(struct gemcut_memtrack *mt, void *ptr, struct memtrack_entry *removed)
+{
+  size_t mask = mt->capa - 1;
+  size_t i = memtrack_slot(mt, ptr);
+  for (;; i = (i + 1) & mask) {
+    if (mt->table[i].ptr == NULL) {
+      return false;
+    }
+
+    if (mt->table[i].ptr == ptr) {
+      break;
+    }
+  }
+
+  *removed = mt->table[i];
+  mt->bytes[removed->owner] -= removed->size;
+  mt->total -= removed->size;
+  mt->count--;
+
+  /* 後続の要素を詰める (backward shift deletion) */
+  for (size_t j = (i + 1) & mask; mt->table[j].ptr; j = (j + 1) & mask) {
+    size_t home = memtrack_slot(mt, mt->table[j].ptr);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      mt->table[i] = mt->table[j];
+      i = j;
+    }
+  }
+  mt->table[i].ptr = NULL;
+
+  return true;
+}
+
+static void *
+memtrack_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  struct gemcut_memtrack *mt = (struct gemcut_memtrack *)ud;
+  struct memtrack_entry removed;
+  bool tracked = (p != NULL && mt->count > 0 && memtrack_remove(mt, p, &removed));
+
+  /* 追跡していないブロックを拡張する場合は、拡張後の大きさ全体を数える */
+  if (size > 0 && mt->limit > 0 && (tracked || mt->owner >= 0) && size > mt->limit - mt->total) {
+    if (tracked) {
+      memtrack_insert(mrb, mt, p, removed.size, removed.owner);
+    }
+    mt->exceeded = true;
+    return NULL;
+  }
+
+  void *q = mt->allocf(mrb, p, size, mt->allocf_ud);
+
+  if (size == 0) {
+    return q;
+  }
+
+  if (q == NULL) {
+    if (tracked) {
+      memtrack_insert(mrb, mt, p, removed.size, removed.owner); /* p は解放されていない */
+    }
+  } else if (tracked) {
+    memtrack_insert(mrb, mt, q, size, removed.owner);
+  } else if (mt->owner >= 0) {
+    memtrack_insert(mrb, mt, q, size, mt->owner);
+  }
+
+  return q;
+}
+
+struct gemcut_memtrack *
+gemcut_memtrack_attach(mrb_state *mrb, int numgems)
+{
+  size_t capa = 256;
+  size_t size = sizeof(struct gemcut_memtrack) + sizeof(size_t) * numgems;
+  struct gemcut_memtrack *mt = (struct gemcut_memtrack *)mrb->allocf(mrb, NULL, size, mrb->allocf_ud);
+  if (mt == NULL) {
+    return NULL;
+  }
+
+  memset(mt, 0, size);
+  mt->table = (struct memtrack_entry *)mrb->allocf(mrb, NULL, sizeof(struct memtrack_entry) * capa, mrb->allocf_ud);
+  if (mt->table == NULL) {
+    mrb->allocf(mrb, mt, 0, mrb->allocf_ud);
+    return NULL;
+  }
+
+  memset(mt->table, 0, sizeof(struct memtrack_entry) * capa);
+  mt->capa = capa;
+  mt->allocf = mrb->allocf;
+  mt->allocf_ud = mrb->allocf_ud;
+  mt->owner = -1;
+  mt->numgems = numgems;
+  mt->bytes = (size_t *)(mt + 1);
+
+  mrb->allocf = memtrack_allocf;
+  mrb->allocf_ud = mt;
+
+  return mt;
+}
+
+void
+gemcut_memtrack_detach(mrb_state *mrb, struct gemcut_memtrack *mt)
+{
+  if (mrb->allocf != memtrack_allocf || mrb->allocf_ud != mt) {
+    return; /* さらに別の allocf に包まれている場合は、以降も呼ばれるため解放できない */
+  }
+
+  mrb->allocf = mt->allocf;
+  mrb->allocf_ud = mt->allocf_ud;
+  mt->allocf(mrb, mt->table, 0, mt->allocf_ud);
+  mt->allocf(mrb, mt, 0, mt->allocf_ud);
+}
+
+int
+gemcut_memtrack_enter(struct gemcut_memtrack *mt, int owner)
+{
+  int prev = mt->owner;
+  mt->owner = owner;
+  return prev;
+}
+
+size_t
+gemcut_memtrack_bytes(const struct gemcut_memtrack *mt, int owner)
+{
+  if (owner < 0 || owner >= mt->numgems) {
+    return 0;
+  }
+
+  return mt->bytes[owner];
+}
+
+void
+gemcut_memtrack_limit(struct gemcut_memtrack *mt, size_t limit)
+{
+  mt->limit = limit;
+}
+
+bool
+gemcut_memtrack_exceeded(const struct gemcut_memtrack *mt)
+{
+  return mt->exceeded;
+}
+
+#endif /* MRUBY_GEMCUT_ENABLE_MEMORY_REPORT || GEMCUT_HAVE_VMSNAP */
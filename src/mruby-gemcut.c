@@ -1,8 +1,10 @@
+#include "sysdep.h"
 #include "internals.h"
 #include <stdbool.h>
 #include <string.h>
 #include <mruby/irep.h> /* for mrb_load_irep() */
 #include <mruby/dump.h> /* for bin_to_uint32() */
+#include <mruby/numeric.h> /* for FIXABLE() */
 
 #define FOREACH_ALIST(T, V, L)                                              \
         for (T V = (L), *_end_ = (L) + sizeof(L) / sizeof((L)[0]);          \
@@ -15,14 +17,61 @@
              &V++)                                                          \
 
 static inline int
-popcount32(uint32_t n)
+popcount64(uint64_t n)
 {
-  n = (n & 0x55555555UL) + ((n >>  1) & 0x55555555UL);
-  n = (n & 0x33333333UL) + ((n >>  2) & 0x33333333UL);
-  n = (n + (n >> 4)) & 0x0f0f0f0fUL; /* 4 + 4 = 8 が最大なので、加算前のビットマスクは不要 */
-  n += n >>  8; /* 以降は 0..32 に収まるため、ビットマスクは不要 */
+#if defined(__GNUC__)
+  return __builtin_popcountll(n);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  return (int)__popcnt64(n);
+#else
+  n = (n & 0x5555555555555555ULL) + ((n >>  1) & 0x5555555555555555ULL);
+  n = (n & 0x3333333333333333ULL) + ((n >>  2) & 0x3333333333333333ULL);
+  n = (n + (n >> 4)) & 0x0f0f0f0f0f0f0f0fULL; /* 4 + 4 = 8 が最大なので、加算前のビットマスクは不要 */
+  n += n >>  8; /* 以降は 0..64 に収まるため、ビットマスクは不要 */
   n += n >> 16;
-  return n & 0xff;
+  n += n >> 32;
+  return (int)(n & 0xff);
+#endif
+}
+
+/*
+ * 最下位の立っているビットの位置を返す (n は 0 であってはならない)
+ */
+static inline int
+ctz64(uint64_t n)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(n);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long i;
+  _BitScanForward64(&i, n);
+  return (int)i;
+#else
+  return popcount64((n & (~n + 1)) - 1);
+#endif
+}
+
+/*
+ * 最上位の立っているビットの位置を返す (n は 0 であってはならない)
+ */
+static inline int
+msb64(uint64_t n)
+{
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(n);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long i;
+  _BitScanReverse64(&i, n);
+  return (int)i;
+#else
+  n |= n >> 1;
+  n |= n >> 2;
+  n |= n >> 4;
+  n |= n >> 8;
+  n |= n >> 16;
+  n |= n >> 32;
+  return popcount64(n) - 1;
+#endif
 }
 
 #define DEFINE_PROTECTED_FUNCTION(DECL, CALLER, ARG, EXTRACTOR, ERR)    \
@@ -55,8 +104,26 @@ struct mgem_spec
   void (*gem_init)(mrb_state *mrb);
   void (*gem_final)(mrb_state *mrb);
   mrb_bool available:1;
-  const uint32_t numdeps:16;
-  const uint16_t *deps;
+  const uint32_t numdeps;
+  const uint32_t *deps;
+  /* gemcut:probe タスクで計測した初期化の費用 (中央値)。計測していなければ 0 */
+  const uint32_t cost_ns;
+  const uint32_t cost_objects;
+  const uint32_t cost_bytes;
+};
+
+struct mgem_index
+{
+  const char *name;
+  uint32_t hash;
+  int id; /* 空き要素であれば -1 */
+  mrb_bool abbrev; /* "mruby-" を省略した名前であれば TRUE */
+};
+
+struct mgem_autoload
+{
+  const char *name; /* 番兵であれば NULL */
+  int id;
 };
 
 #ifndef MRB_PRESYM_SCANNING
@@ -74,18 +141,100 @@ struct mgem_spec
 # define NO_PRESYM(...) do { } while (0)
 #endif
 
+/* 記録簿の要素。gem の番号が収まる最小の型 */
+#if MGEMS_POPULATION <= UINT16_MAX
+typedef uint16_t gemcut_journal_id;
+#else
+typedef uint32_t gemcut_journal_id;
+#endif
+
 enum gemcut_status {
   gemcut_normal = 0,
   gemcut_locked = 1,
   gemcut_sealed = 2,
 };
 
+#ifdef GEMCUT_HAVE_VMSNAP
+/* 巻き戻すための gem の組み合わせと、クラス・モジュールの状態 */
+struct gemcut_savepoint
+{
+  bool ready:1;          /* vm の記録が完了していれば true */
+  bool defined_module:1;
+  bool autoload:1;
+  bitmap_unit loaded[MGEMS_BITMAP_UNITS];
+  int journal_len;
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+  int numstats;
+#endif
+  struct gemcut_vmsnap *vm;
+};
+#endif
+
 struct gemcut
 {
   bool set_atexit:1;
   bool defined_module:1;
+  bool defer_gc:1;
+  bool autoload:1;
   enum gemcut_status status:2;
   bitmap_unit loaded[MGEMS_BITMAP_UNITS];
+
+  int loaded_count;
+
+  /*
+   * gem_final を持つ gem (mgems_finalizers) を、gem_init を終えた順に並べた記録簿。
+   * 後始末では末尾から逆順に gem_final を呼び出す。
+   * gem_init が例外で中断された gem は載らない。
+   */
+  int journal_len;
+  gemcut_journal_id journal[MGEMS_FINALIZERS > 0 ? MGEMS_FINALIZERS : 1];
+
+  mrb_value self;     /* この構造体を保持する RData */
+  mrb_value keeper;   /* GC アリーナのスナップショットを保持する配列 (RData のインスタンス変数から参照される) */
+  int keeper_top;     /* keeper のうち使用中の要素数 */
+  mrb_value features; /* loaded_features の凍結された配列。loaded が変わると nil に戻す */
+
+  struct {
+    bool active; /* before と after のどちらかが設定されていれば true */
+    mruby_gemcut_hook_f *before;
+    mruby_gemcut_hook_f *after;
+    void *ud;
+  } hooks;
+
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+  struct {
+    int owner; /* 計測中の gem の番号。計測していなければ -1 */
+    mrb_allocf allocf;
+    void *allocf_ud;
+    uint64_t start_ns;
+    size_t live;
+    uint64_t alloc_calls;
+    uint64_t alloc_bytes;
+  } probe;
+
+  int numstats;
+  struct mruby_gemcut_stat stats[MGEMS_POPULATION]; /* 初期化した順 */
+#endif
+
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+  struct gemcut_memtrack *memtrack;
+  int64_t objects[MGEMS_POPULATION]; /* gem_init の前後で増えた生存オブジェクトの数 */
+#endif
+
+#ifdef GEMCUT_HAVE_VMSNAP
+  struct gemcut_savepoint checkpoint; /* mruby_gemcut_checkpoint() で記録したもの */
+  struct gemcut_savepoint txn;        /* mruby_gemcut_require_with_budget() の間だけ使う */
+
+  struct {
+    bool active:1;
+    bool exceeded:1; /* メモリの確保を断った */
+    bool timeout:1;  /* 時間の予算を超えた */
+    int current;     /* 初期化中の gem の番号 */
+    struct gemcut_memtrack *memtrack; /* メモリの予算がなければ NULL */
+    uint64_t start_ns;
+    uint64_t max_ns;
+  } budget;
+#endif
 };
 
 static bool
@@ -97,9 +246,7 @@ gemcut_loaded_p_by_id(const struct gemcut *g, int id)
     return false;
   }
 
-  int inv = MGEMS_POPULATION - id - 1;
-
-  return ((g->loaded[inv / MGEMS_UNIT_BITS] >> (inv % MGEMS_UNIT_BITS)) & 1) ? true : false;
+  return ((g->loaded[id / MGEMS_UNIT_BITS] >> (id % MGEMS_UNIT_BITS)) & 1) ? true : false;
 }
 
 static void
@@ -107,42 +254,123 @@ gemcut_set_loaded_by_id(struct gemcut *g, int id)
 {
   mrb_assert(id >= 0 && id < MGEMS_POPULATION);
 
-  int inv = MGEMS_POPULATION - id - 1;
-  g->loaded[inv / MGEMS_UNIT_BITS] |= 1UL << (inv % MGEMS_UNIT_BITS);
+  bitmap_unit bit = (bitmap_unit)1 << (id % MGEMS_UNIT_BITS);
+  if ((g->loaded[id / MGEMS_UNIT_BITS] & bit) == 0) {
+    g->loaded[id / MGEMS_UNIT_BITS] |= bit;
+    g->loaded_count++;
+    g->features = mrb_nil_value();
+  }
+}
+
+/*
+ * gem_init を終えた gem が gem_final を持っていれば、記録簿の at 番目に挿入して true を返す。
+ * at は通常は末尾 (journal_len) である。
+ */
+static bool
+gemcut_journal_insert(struct gemcut *g, int at, int id)
+{
+  if (((mgems_finalizers[id / MGEMS_UNIT_BITS] >> (id % MGEMS_UNIT_BITS)) & 1) == 0) {
+    return false;
+  }
+
+  mrb_assert(g->journal_len < MGEMS_FINALIZERS);
+  mrb_assert(at >= 0 && at <= g->journal_len);
+
+  memmove(&g->journal[at + 1], &g->journal[at], sizeof(g->journal[0]) * (g->journal_len - at));
+  g->journal[at] = (gemcut_journal_id)id;
+  g->journal_len++;
+
+  return true;
+}
+
+/*
+ * FNV-1a (32 bits)
+ * `buildlib/internals.rb` の Gemcut.fnv1a32 と同じ値を返さなければならない
+ */
+static uint32_t
+gemcut_hash(const char name[], size_t len)
+{
+  uint32_t h = 0x811c9dc5UL;
+  for (; len > 0; len--, name++) {
+    h = (h ^ (uint8_t)*name) * 0x01000193UL;
+  }
+  return h & 0xffffffffUL;
 }
 
 static int
-gemcut_lookup(mrb_state *mrb, const char name[], mrb_bool autoprefix)
+gemcut_lookup(const char name[], mrb_bool autoprefix)
 {
-  for (;;) {
-    FOREACH_ALIST(const struct mgem_spec, *mgem, mgems_list) {
-      if (strcmp(name, mgem->name) == 0) {
-        return mgem - mgems_list;
-      }
+  size_t len = strlen(name);
+  if (len > MGEMS_NAME_MAX) {
+    return -1;
+  }
+
+  uint32_t hash = gemcut_hash(name, len);
+  for (uint32_t i = hash;; i++) {
+    const struct mgem_index *e = &mgems_index[i & (MGEMS_INDEX_SIZE - 1)];
+    if (e->id < 0) {
+      return -1;
     }
 
-    if (!autoprefix) {
-      break;
-    } else {
-      autoprefix = FALSE;
-      int ai = mrb_gc_arena_save(mrb);
-      mrb_value str = mrb_str_new_cstr(mrb, "mruby-");
-      mrb_str_cat_cstr(mrb, str, name);
-      name = mrb_str_to_cstr(mrb, str);
-      mrb_gc_arena_restore(mrb, ai);
+    if (e->hash == hash && (autoprefix || !e->abbrev) && strcmp(name, e->name) == 0) {
+      return e->id;
     }
   }
-
-  return -1;
 }
 
 #define id_gemcut mrb_intern_lit(mrb, "mruby-gemcut-structure")
+#define id_keeper mrb_intern_lit(mrb, "gcarena@mruby-gemcut")
+#define id_features mrb_intern_lit(mrb, "features@mruby-gemcut")
+#define id_checkpoint mrb_intern_lit(mrb, "checkpoint@mruby-gemcut")
+#define id_transaction mrb_intern_lit(mrb, "transaction@mruby-gemcut")
+
+/*
+ * mrb_state から struct gemcut を引くたびにグローバル変数を検索しないように、直前の結果をスレッドごとに覚えておく。
+ * いずれかの struct gemcut が解放されると gemcut_epoch が進み、全てのスレッドの記憶が無効になる。
+ * (解放された mrb_state と同じアドレスに別の mrb_state が作られる場合があるため)
+ */
+static uint32_t gemcut_epoch = 0;
+
+#ifdef AUX_THREAD_LOCAL
+static AUX_THREAD_LOCAL struct {
+  const mrb_state *mrb;
+  struct gemcut *gcut;
+  uint32_t epoch;
+} gemcut_cache;
+#endif
+
+static void
+gemcut_free(mrb_state *mrb, void *ptr)
+{
+  aux_atomic_increment(&gemcut_epoch);
+#ifdef AUX_THREAD_LOCAL
+  /* mrb_close() の途中で再び引かれても、解放した構造体を覚え直さないようにする */
+  if (gemcut_cache.gcut == ptr) {
+    gemcut_cache.mrb = NULL;
+    gemcut_cache.gcut = NULL;
+  }
+#endif
+  DATA_PTR(((struct gemcut *)ptr)->self) = NULL;
+#ifdef GEMCUT_HAVE_VMSNAP
+  gemcut_vmsnap_free(mrb, ((struct gemcut *)ptr)->checkpoint.vm);
+  gemcut_vmsnap_free(mrb, ((struct gemcut *)ptr)->txn.vm);
+#endif
+  mrb_free(mrb, ptr);
+}
 
-static const mrb_data_type gemcut_type = { "mruby-gemcut", mrb_free };
+static const mrb_data_type gemcut_type = { "mruby-gemcut", gemcut_free };
 
 static mrb_value
 get_gemcut_main(mrb_state *mrb, struct gemcut **gcutp)
 {
+#ifdef AUX_THREAD_LOCAL
+  if (gemcut_cache.mrb == mrb && gemcut_cache.epoch == aux_atomic_load(&gemcut_epoch)) {
+    *gcutp = gemcut_cache.gcut;
+    return gemcut_cache.gcut->self;
+  }
+#endif
+
+  uint32_t epoch = aux_atomic_load(&gemcut_epoch);
   mrb_value v = mrb_gv_get(mrb, id_gemcut);
   *gcutp = (struct gemcut *)mrb_data_check_get_ptr(mrb, v, &gemcut_type);
 
@@ -153,13 +381,29 @@ get_gemcut_main(mrb_state *mrb, struct gemcut **gcutp)
     mrb_define_class(mrb, "LoadError", mrb_class_get(mrb, "ScriptError"));
 
     struct RData *d = mrb_data_object_alloc(mrb, NULL, NULL, &gemcut_type);
-    d->data = mrb_calloc(mrb, 1, sizeof(struct gemcut));
+    struct gemcut *gcut = (struct gemcut *)mrb_calloc(mrb, 1, sizeof(struct gemcut));
+    d->data = gcut;
     mrb_gv_set(mrb, id_gemcut, mrb_obj_value(d));
-    *gcutp = (struct gemcut *)d->data;
+    gcut->self = mrb_obj_value(d);
+    gcut->keeper = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, gcut->self, id_keeper, gcut->keeper);
+    gcut->features = mrb_nil_value();
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+    gcut->probe.owner = -1;
+#endif
+    *gcutp = gcut;
     mrb_gc_arena_restore(mrb, ai);
     v = mrb_obj_value(d);
   }
 
+#ifdef AUX_THREAD_LOCAL
+  gemcut_cache.mrb = mrb;
+  gemcut_cache.gcut = *gcutp;
+  gemcut_cache.epoch = epoch;
+#else
+  (void)epoch;
+#endif
+
   return v;
 }
 
@@ -199,73 +443,107 @@ gemcut_check_sealed(mrb_state *mrb)
 }
 
 static mrb_value
-gemcut_imitate_to_main(mrb_state *dest, void *opaque)
+gemcut_cleanup_main(mrb_state *mrb, void *opaque)
 {
-  mrb_state *src = (mrb_state *)opaque;
-  const struct gemcut *gsrc = get_gemcut(src);
-  struct gemcut *gdest = get_gemcut(dest);
-  if (gdest->status != gemcut_normal) {
-    gemcut_sealed_error(dest);
-  }
-
-  for (int i = 0; i < MGEMS_POPULATION; i++) {
-    if (gemcut_loaded_p_by_id(gsrc, i) && !gemcut_loaded_p_by_id(gdest, i)) {
-      // TODO: mruby_gemcut_require() ではなくて直接 gemcut_require_by_id_main_top() を呼び出すようにする
-      mruby_gemcut_require(dest, mgems_list[i].name);
-    }
-  }
-
+  const struct mgem_spec *mgem = (const struct mgem_spec *)opaque;
+  mgem->gem_final(mrb);
   return mrb_nil_value();
 }
 
-DEFINE_PROTECTED_FUNCTION(
-    MRB_API mrb_value mruby_gemcut_imitate_to(mrb_state *mrb, mrb_state *src),
-    gemcut_imitate_to_main, src, RESULT_PASSTHROUGH, ret)
-
 static mrb_value
-gemcut_cleanup_main(mrb_state *mrb, void *opaque)
+gemcut_init_main(mrb_state *mrb, void *opaque)
 {
   const struct mgem_spec *mgem = (const struct mgem_spec *)opaque;
-  mgem->gem_final(mrb);
+  aux_ignite_gem_init(mrb, mgem->gem_init);
   return mrb_nil_value();
 }
 
+/*
+ * フックを呼び出しながら、保護区間の中で gem_init または gem_final を呼び出す。
+ * 例外が発生した場合も after を呼び出してから、その例外オブジェクトを返す。
+ */
+static mrb_value
+gemcut_hooked_call(mrb_state *mrb, const struct gemcut *gcut, enum mruby_gemcut_hook_event event, int id, mrb_bool *error)
+{
+  const struct mgem_spec *mgem = &mgems_list[id];
+  mruby_gemcut_hook_f *after = gcut->hooks.after;
+  void *ud = gcut->hooks.ud;
+
+  if (gcut->hooks.before) {
+    gcut->hooks.before(mrb, event, id, mgem->name, TRUE, ud);
+  }
+
+  mrb_value (*body)(mrb_state *, void *) = (event == MRUBY_GEMCUT_HOOK_INIT) ? gemcut_init_main : gemcut_cleanup_main;
+  mrb_value ret = mrb_protect_error(mrb, body, (void *)(uintptr_t)mgem, error);
+
+  if (after) {
+    after(mrb, event, id, mgem->name, !*error, ud);
+  }
+
+  return ret;
+}
+
+/*
+ * 記録簿の bottom 番目以降に載っている gem の gem_final を、初期化を終えた順とは逆に呼び出し、
+ * 記録簿を bottom 個に切り詰める。
+ * 記録簿には gem_final を持つ gem しか載らないため、手間は後始末が必要な gem の数に比例する。
+ */
+static void
+gemcut_finalize_journal(mrb_state *mrb, struct gemcut *gcut, int bottom)
+{
+  int ai = mrb_gc_arena_save(mrb);
+  while (gcut->journal_len > bottom) {
+    int id = gcut->journal[--gcut->journal_len];
+    if (gcut->hooks.active) {
+      mrb_bool error;
+      gemcut_hooked_call(mrb, gcut, MRUBY_GEMCUT_HOOK_FINAL, id, &error);
+    } else {
+      mrb_protect_error(mrb, gemcut_cleanup_main, (void *)(uintptr_t)&mgems_list[id], NULL);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
 static void
 gemcut_cleanup(mrb_state *mrb)
 {
   struct gemcut *gcut = get_gemcut_noraise(mrb);
   if (gcut == NULL) { return; }
 
-  const struct mgem_spec *mgem = mgems_list + MGEMS_POPULATION - 1;
-  int ai = mrb_gc_arena_save(mrb);
-  for (int i = MGEMS_POPULATION - 1; i >= 0; i--, mgem--) {
-    if (gemcut_loaded_p_by_id(gcut, i) && mgem->gem_final) {
-      mrb_protect_error(mrb, gemcut_cleanup_main, (void *)(uintptr_t)mgem, NULL);
-      mrb_gc_arena_restore(mrb, ai);
-    }
+  gemcut_finalize_journal(mrb, gcut, 0);
+
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+  if (gcut->memtrack) {
+    gemcut_memtrack_detach(mrb, gcut->memtrack);
+    gcut->memtrack = NULL;
   }
+#endif
 }
 
-#define ID_GCARENA  mrb_intern_lit(mrb, "gcarena@mruby-gemcut")
-
-static void
-gemcut_snapshot_gc_arena(mrb_state *mrb)
+/*
+ * GC アリーナの内容を gcut->keeper の末尾に退避して、退避した位置を返す。
+ * keeper は使い回すため、要素数が足りている限り Ruby のオブジェクトを確保しない。
+ * gem_init の中から入れ子に呼ばれた場合も、退避した位置が異なるため上書きしない。
+ */
+static int
+gemcut_snapshot_gc_arena(mrb_state *mrb, struct gemcut *gcut)
 {
   const mrb_gc *gc = &mrb->gc;
-  mrb_value gcarena = mrb_ary_new_capa(mrb, gc->arena_idx);
+  int base = gcut->keeper_top;
   struct RBasic **bp = gc->arena;
-  size_t i = gc->arena_idx;
+  int i = gc->arena_idx;
 
-  for (; i > 0; i--, bp++) {
-    mrb_ary_push(mrb, gcarena, mrb_obj_value(*bp));
+  mrb_ary_set(mrb, gcut->keeper, base, mrb_fixnum_value(i));
+  for (int n = base + 1; i > 0; i--, bp++, n++) {
+    mrb_ary_set(mrb, gcut->keeper, n, mrb_obj_value(*bp));
   }
+  gcut->keeper_top = base + 1 + gc->arena_idx;
 
-  mrb_obj_freeze(mrb, gcarena);
-  mrb_gv_set(mrb, ID_GCARENA, gcarena);
+  return base;
 }
 
 static void
-gemcut_rollback_gc_arena_fallback(mrb_state *mrb, mrb_gc *gc, mrb_value gcarena)
+gemcut_rollback_gc_arena_fallback(mrb_state *mrb, mrb_gc *gc, mrb_value keeper)
 {
   int i = gc->arena_capa;
   struct RBasic **bp = gc->arena;
@@ -274,36 +552,39 @@ gemcut_rollback_gc_arena_fallback(mrb_state *mrb, mrb_gc *gc, mrb_value gcarena)
     *bp = (struct RBasic *)mrb->object_class;
   }
 
-  *gc->arena = (struct RBasic *)mrb_obj_ptr(gcarena);
+  *gc->arena = (struct RBasic *)mrb_obj_ptr(keeper);
   gc->arena_idx = 1;
 }
 
 static void
-gemcut_rollback_gc_arena(mrb_state *mrb)
+gemcut_rollback_gc_arena(mrb_state *mrb, struct gemcut *gcut, int base)
 {
   mrb_gc *gc = &mrb->gc;
-  mrb_value gcarena = mrb_gv_get(mrb, ID_GCARENA);
-  mrb_gv_remove(mrb, ID_GCARENA);
-  size_t arenalen = RARRAY_LEN(gcarena);
+  const mrb_value *vp = RARRAY_PTR(gcut->keeper) + base;
+  int arenalen = (int)mrb_fixnum(*vp++);
+
+  gcut->keeper_top = base;
 
 #ifdef MRB_GC_FIXED_ARENA
   if (arenalen > MRB_GC_ARENA_SIZE) {
-    gemcut_rollback_gc_arena_fallback(mrb, gc, gcarena);
+    gemcut_rollback_gc_arena_fallback(mrb, gc, gcut->keeper);
     return;
   }
 #else
-  if (arenalen > (size_t)gc->arena_capa) {
-    mrb_value *p = (mrb_value *)mrb_realloc_simple(mrb, gc->arena, arenalen * sizeof(mrb_value));
+  if (arenalen > gc->arena_capa) {
+    struct RBasic **p = (struct RBasic **)mrb_realloc_simple(mrb, gc->arena, arenalen * sizeof(struct RBasic *));
     if (p == NULL) {
-      gemcut_rollback_gc_arena_fallback(mrb, gc, gcarena);
+      gemcut_rollback_gc_arena_fallback(mrb, gc, gcut->keeper);
       return;
     }
+    gc->arena = p;
+    gc->arena_capa = arenalen;
+    vp = RARRAY_PTR(gcut->keeper) + base + 1;
   }
 #endif
 
   struct RBasic **bp = gc->arena;
-  const mrb_value *vp = RARRAY_PTR(gcarena);
-  size_t i = arenalen;
+  int i = arenalen;
 
   for (; i > 0; i--, bp++, vp++) {
     if (mrb_immediate_p(*vp)) {
@@ -314,12 +595,19 @@ gemcut_rollback_gc_arena(mrb_state *mrb)
   }
 
   gc->arena_idx = arenalen;
+
+  /* 退避していたオブジェクトを keeper から手放す (要素数は変えない) */
+  for (i = base + arenalen; i >= base; i--) {
+    mrb_ary_set(mrb, gcut->keeper, i, mrb_nil_value());
+  }
 }
 
+#define gemcut_load_error(MRB, NAME) gemcut_load_error_fmt(MRB, "cannot load such file - %" AUX_PRIs, NAME)
+
 static mrb_value
-gemcut_load_error(mrb_state *mrb, const char *name)
+gemcut_load_error_fmt(mrb_state *mrb, const char *fmt, const char *name)
 {
-  mrb_value mesg = mrb_format(mrb, "cannot load such file - %" AUX_PRIs, AUX_PRIs_MAKE(name));
+  mrb_value mesg = mrb_format(mrb, fmt, AUX_PRIs_MAKE(name));
   mrb_value err = mrb_exc_new_str(mrb, mrb_exc_get(mrb, "LoadError"), mesg);
   if (mrb->jmp) {
     mrb_exc_raise(mrb, err);
@@ -327,260 +615,1980 @@ gemcut_load_error(mrb_state *mrb, const char *name)
   return err;
 }
 
-struct gemcut_require_by_id_main_top
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+/*
+ * gem_init の間だけ mrb->allocf をすり替えて、メモリ確保の回数と量を数える
+ */
+static void *
+gemcut_stats_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
 {
-  struct gemcut *gcut;
-  int id;
-};
+  struct gemcut *gcut = (struct gemcut *)ud;
+  if (size > 0) {
+    gcut->probe.alloc_calls++;
+    gcut->probe.alloc_bytes += size;
+  }
+  return gcut->probe.allocf(mrb, p, size, gcut->probe.allocf_ud);
+}
 
 static void
-gemcut_require_by_id_main(mrb_state *mrb, struct gemcut *gcut, int id, int ai)
+gemcut_stats_begin(mrb_state *mrb, struct gemcut *gcut, int id)
 {
-  const struct mgem_spec *spec = &mgems_list[id];
-
-  {
-    const uint16_t *deps = spec->deps;
-    for (int i = spec->numdeps; i > 0; i--, deps++) {
-      if (!gemcut_loaded_p_by_id(gcut, *deps)) {
-        gemcut_require_by_id_main(mrb, gcut, *deps, ai);
-      }
-    }
+  if (gcut->probe.owner >= 0) {
+    return; /* gem_init の中から require された gem は呼び出し元に含める */
   }
 
-  gemcut_set_loaded_by_id(gcut, id);
-  if (spec->gem_init) {
-    aux_ignite_gem_init(mrb, spec->gem_init);
-    mrb_gc_arena_restore(mrb, ai);
-  }
+  gcut->probe.owner = id;
+  gcut->probe.allocf = mrb->allocf;
+  gcut->probe.allocf_ud = mrb->allocf_ud;
+  gcut->probe.alloc_calls = 0;
+  gcut->probe.alloc_bytes = 0;
+  gcut->probe.live = mrb->gc.live;
+  mrb->allocf = gemcut_stats_allocf;
+  mrb->allocf_ud = gcut;
+  gcut->probe.start_ns = aux_monotonic_ns();
 }
 
-static mrb_value
-gemcut_require_by_id_main_top(mrb_state *mrb, void *opaque)
+static void
+gemcut_stats_end(mrb_state *mrb, struct gemcut *gcut, int id)
 {
-  struct gemcut_require_by_id_main_top *p = (struct gemcut_require_by_id_main_top *)opaque;
-  if (!p->gcut->set_atexit) {
-    mrb_state_atexit(mrb, gemcut_cleanup);
-    p->gcut->set_atexit = true;
-  }
+  uint64_t elapsed = aux_monotonic_ns() - gcut->probe.start_ns;
 
-  gemcut_require_by_id_main(mrb, p->gcut, p->id, mrb_gc_arena_save(mrb));
+  if (gcut->probe.owner != id || mrb->allocf != gemcut_stats_allocf) {
+    return;
+  }
 
-  return mrb_true_value();
+  mrb->allocf = gcut->probe.allocf;
+  mrb->allocf_ud = gcut->probe.allocf_ud;
+  gcut->probe.owner = -1;
+
+  if (gcut->numstats < MGEMS_POPULATION) {
+    struct mruby_gemcut_stat *st = &gcut->stats[gcut->numstats++];
+    st->name = mgems_list[id].name;
+    st->init_ns = elapsed;
+    st->alloc_calls = gcut->probe.alloc_calls;
+    st->alloc_bytes = gcut->probe.alloc_bytes;
+    st->objects = (int64_t)mrb->gc.live - (int64_t)gcut->probe.live;
+  }
 }
 
-static mrb_value
-gemcut_require_main(mrb_state *mrb, void *opaque)
+/*
+ * 計測中の gem の番号を返す。計測していなければ -1
+ */
+static int
+gemcut_stats_owner(const struct gemcut *gcut)
 {
-  struct gemcut *gcut = get_gemcut(mrb);
+  return gcut->probe.owner;
+}
 
-  if (gcut->status) {
-    gemcut_sealed_error(mrb);
+/*
+ * gem_init が例外を起こした場合に mrb->allocf を元に戻す。
+ * outer は保護区間に入る前の gemcut_stats_owner() で、その計測は呼び出し元のものであるため続けさせる。
+ */
+static void
+gemcut_stats_cancel(mrb_state *mrb, struct gemcut *gcut, int outer)
+{
+  if (gcut->probe.owner >= 0 && gcut->probe.owner != outer) {
+    mrb->allocf = gcut->probe.allocf;
+    mrb->allocf_ud = gcut->probe.allocf_ud;
+    gcut->probe.owner = -1;
   }
+}
+#else
+# define gemcut_stats_begin(MRB, GCUT, ID) do { } while (0)
+# define gemcut_stats_end(MRB, GCUT, ID) do { } while (0)
+# define gemcut_stats_owner(GCUT) (-1)
+# define gemcut_stats_cancel(MRB, GCUT, OUTER) ((void)(OUTER))
+#endif
 
-  const char *name = (const char *)opaque;
-  int id = gemcut_lookup(mrb, name, TRUE);
-  if (id < 0) {
-    return gemcut_load_error(mrb, name);
-  }
+struct gemcut_memreport_frame
+{
+  int owner;
+  size_t live;
+};
 
-  if (gemcut_loaded_p_by_id(gcut, id)) {
-    return mrb_false_value();
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+/*
+ * gem_init の前後で完全 GC を行い、その間に確保されて生き残ったメモリとオブジェクトを gem に帰属させる。
+ * gem_init の中から require された gem の分は、その gem の方に数えられる。
+ */
+static void
+gemcut_memreport_begin(mrb_state *mrb, struct gemcut *gcut, int id, struct gemcut_memreport_frame *frame)
+{
+  if (gcut->memtrack == NULL) {
+    gcut->memtrack = gemcut_memtrack_attach(mrb, MGEMS_POPULATION);
   }
 
-  const struct mgem_spec *spec = &mgems_list[id];
-  if (!spec->available) {
-    return gemcut_load_error(mrb, spec->name);
+  mrb_full_gc(mrb);
+  frame->live = mrb->gc.live;
+  frame->owner = gcut->memtrack ? gemcut_memtrack_enter(gcut->memtrack, id) : -1;
+}
+
+static void
+gemcut_memreport_end(mrb_state *mrb, struct gemcut *gcut, int id, const struct gemcut_memreport_frame *frame)
+{
+  if (gcut->memtrack) {
+    gemcut_memtrack_enter(gcut->memtrack, frame->owner);
   }
 
-  struct gemcut_require_by_id_main_top args = { gcut, id };
-  gemcut_snapshot_gc_arena(mrb);
-  mrb_bool error;
-  mrb_value ret = mrb_protect_error(mrb, gemcut_require_by_id_main_top, &args, &error);
-  gemcut_rollback_gc_arena(mrb);
+  mrb_full_gc(mrb);
+  gcut->objects[id] += (int64_t)mrb->gc.live - (int64_t)frame->live;
+}
 
-  if (error && mrb->jmp) {
-    mrb_exc_raise(mrb, ret);
+static void
+gemcut_memreport_cancel(struct gemcut *gcut)
+{
+  if (gcut->memtrack) {
+    gemcut_memtrack_enter(gcut->memtrack, -1);
   }
-
-  return ret;
 }
+#else
+# define gemcut_memreport_begin(MRB, GCUT, ID, FRAME) ((void)(FRAME))
+# define gemcut_memreport_end(MRB, GCUT, ID, FRAME) do { } while (0)
+# define gemcut_memreport_cancel(GCUT) do { } while (0)
+#endif
 
-DEFINE_PROTECTED_FUNCTION(
-    MRB_API mrb_value mruby_gemcut_require(mrb_state *mrb, const char *name),
-    gemcut_require_main, (void *)(uintptr_t)name, RESULT_PASSTHROUGH, ret)
+/*
+ * mrblib の命令列とリテラルは、mruby-3.0 以降では読み込み専用の構造体として、
+ * それより前ではバイナリ形式の静的な配列から (FLAG_SRC_STATIC によって) 直接参照されるため、
+ * 同じ gem を初期化した mrb_state の間ですでに共有されている。
+ * 一方で irep 構造体そのものはシンボルが mrb_state ごとに異なり、参照カウントも GC が書き換えるため共有できない。
+ *
+ * ここでは mrblib を持つ gem の初期化回数をプロセス全体で数えるだけに留める。
+ */
+static uint32_t gemcut_mrblib_loads[MGEMS_POPULATION];
 
-static mrb_value
-gemcut_s_require(mrb_state *mrb, mrb_value mod)
+static void
+gemcut_mrblib_count(int id)
 {
-  (void)mod;
-
-  const char *name;
-  mrb_get_args(mrb, "z", &name);
-  return gemcut_require_main(mrb, (void *)(uintptr_t)name);
+  if ((mgems_mrblib[id / MGEMS_UNIT_BITS] >> (id % MGEMS_UNIT_BITS)) & 1) {
+    aux_atomic_increment(&gemcut_mrblib_loads[id]);
+  }
 }
 
-static mrb_value
-gemcut_loaded_features_main(mrb_state *mrb, void *opaque)
+MRB_API void
+mruby_gemcut_mrblib_loads(struct mruby_gemcut_mrblib_loads *loads)
 {
-  (void)opaque;
-
-  struct gemcut *gcut = get_gemcut(mrb);
-  mrb_value ary = mrb_ary_new(mrb);
+  memset(loads, 0, sizeof(*loads));
   for (int i = 0; i < MGEMS_POPULATION; i++) {
-    if (gemcut_loaded_p_by_id(gcut, i)) {
-      mrb_ary_push(mrb, ary, mrb_str_new_static(mrb, mgems_list[i].name, strlen(mgems_list[i].name)));
+    uint32_t n = aux_atomic_load(&gemcut_mrblib_loads[i]);
+    if (n == 0) {
+      continue;
     }
+
+    loads->loads += n;
+    loads->reloads += n - 1;
   }
-  return ary;
 }
 
-DEFINE_PROTECTED_FUNCTION(
-    MRB_API mrb_value mruby_gemcut_loaded_features(mrb_state *mrb),
-    gemcut_loaded_features_main, NULL, RESULT_PASSTHROUGH, mrb_nil_value())
-
-static mrb_value
-gemcut_s_loaded_features(mrb_state *mrb, mrb_value mod)
+#ifdef GEMCUT_HAVE_VMSNAP
+/*
+ * メモリの予算は mrb->allocf をすり替えて、予算の開始後に確保されたまま生存しているメモリの量で数える。
+ * 予算を超える確保は断られ、mruby は NoMemoryError 例外を発生させる。
+ *
+ * 追跡用の表を確保できなかった場合は false を返す。
+ */
+static bool
+gemcut_budget_begin(mrb_state *mrb, struct gemcut *gcut, uint64_t max_ns, size_t max_bytes)
 {
-  (void)mod;
+  gcut->budget.exceeded = false;
+  gcut->budget.timeout = false;
+  gcut->budget.current = -1;
+  gcut->budget.max_ns = max_ns;
+  gcut->budget.memtrack = NULL;
+
+  if (max_bytes > 0) {
+    gcut->budget.memtrack = gemcut_memtrack_attach(mrb, 1);
+    if (gcut->budget.memtrack == NULL) {
+      gcut->budget.exceeded = true;
+      return false;
+    }
+    gemcut_memtrack_limit(gcut->budget.memtrack, max_bytes);
+    gemcut_memtrack_enter(gcut->budget.memtrack, 0);
+  }
 
-  gemcut_check_sealed(mrb);
-  return gemcut_loaded_features_main(mrb, NULL);
+  gcut->budget.active = true;
+  gcut->budget.start_ns = aux_monotonic_ns();
+  return true;
 }
 
-static mrb_value
-gemcut_loaded_count_main(mrb_state *mrb, void *opaque)
+static void
+gemcut_budget_end(mrb_state *mrb, struct gemcut *gcut)
 {
-  struct gemcut *gcut = get_gemcut(mrb);
-  int count = 0;
-  for (int i = 0; i < MGEMS_BITMAP_UNITS; i++) {
-    count += popcount32(gcut->loaded[i]);
+  gcut->budget.active = false;
+
+  struct gemcut_memtrack *mt = gcut->budget.memtrack;
+  if (mt) {
+    gcut->budget.memtrack = NULL;
+    gcut->budget.exceeded = gemcut_memtrack_exceeded(mt);
+    /* さらに別の allocf に包まれていて外せない場合に備えて、素通りさせておく */
+    gemcut_memtrack_limit(mt, 0);
+    gemcut_memtrack_enter(mt, -1);
+    gemcut_memtrack_detach(mrb, mt);
   }
+}
 
-  if (opaque) {
+/*
+ * gem_init の前に呼び出し、失敗した場合にどの gem であったのかを記録する。
+ * gem_init の中で require された gem が失敗した場合は、その gem が記録される。
+ */
+static void
+gemcut_budget_enter(struct gemcut *gcut, int id)
+{
+  if (gcut->budget.active) {
+    gcut->budget.current = id;
+  }
+}
+
+/*
+ * gem_init の後に呼び出し、それまでに掛かった時間が予算を超えていれば例外を発生させる。
+ * gem_init そのものを途中で止めることはできない。
+ */
+static void
+gemcut_budget_check(mrb_state *mrb, struct gemcut *gcut, int id)
+{
+  if (!gcut->budget.active || gcut->budget.max_ns == 0) {
+    return;
+  }
+
+  if (aux_monotonic_ns() - gcut->budget.start_ns > gcut->budget.max_ns) {
+    gcut->budget.current = id;
+    gcut->budget.timeout = true;
+    mrb_raise(mrb, E_RUNTIME_ERROR, "time budget exceeded");
+  }
+}
+#else
+# define gemcut_budget_enter(GCUT, ID) do { } while (0)
+# define gemcut_budget_check(MRB, GCUT, ID) do { } while (0)
+#endif
+
+struct gemcut_require_bitmap_main_top
+{
+  struct gemcut *gcut;
+  const bitmap_unit *want;
+};
+
+/*
+ * mgems_list は依存される gem が先に来るように並べられているため、
+ * 依存関係の閉包から読み込み済みのものを除いて番号の昇順に初期化すればよい。
+ */
+static void
+gemcut_require_bitmap_main(mrb_state *mrb, struct gemcut *gcut, const bitmap_unit want[], int ai)
+{
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    for (bitmap_unit missing = want[u] & ~gcut->loaded[u]; missing != 0; missing &= missing - 1) {
+      int i = u * MGEMS_UNIT_BITS + ctz64(missing);
+
+      /* gem_init の中で別の gem が require されている場合もある */
+      if (gemcut_loaded_p_by_id(gcut, i)) {
+        continue;
+      }
+
+      const struct mgem_spec *spec = &mgems_list[i];
+      gemcut_set_loaded_by_id(gcut, i);
+      gemcut_mrblib_count(i);
+      if (spec->gem_init) {
+        struct gemcut_memreport_frame frame;
+        gemcut_memreport_begin(mrb, gcut, i, &frame);
+        gemcut_stats_begin(mrb, gcut, i);
+        gemcut_budget_enter(gcut, i);
+        if (gcut->hooks.active) {
+          mrb_bool error;
+          mrb_value ret = gemcut_hooked_call(mrb, gcut, MRUBY_GEMCUT_HOOK_INIT, i, &error);
+          if (error) {
+            mrb_exc_raise(mrb, ret);
+          }
+        } else {
+          aux_ignite_gem_init(mrb, spec->gem_init);
+        }
+        gemcut_journal_insert(gcut, gcut->journal_len, i);
+        gemcut_stats_end(mrb, gcut, i);
+        mrb_gc_arena_restore(mrb, ai);
+        gemcut_memreport_end(mrb, gcut, i, &frame);
+        gemcut_budget_check(mrb, gcut, i);
+      }
+    }
+  }
+}
+
+static mrb_value
+gemcut_require_bitmap_main_top(mrb_state *mrb, void *opaque)
+{
+  struct gemcut_require_bitmap_main_top *p = (struct gemcut_require_bitmap_main_top *)opaque;
+  if (!p->gcut->set_atexit) {
+    mrb_state_atexit(mrb, gemcut_cleanup);
+    p->gcut->set_atexit = true;
+  }
+
+  gemcut_require_bitmap_main(mrb, p->gcut, p->want, mrb_gc_arena_save(mrb));
+
+  return mrb_true_value();
+}
+
+/*
+ * id の gem と、その依存関係にある gem のうち loaded に含まれないものを want に加える。
+ * 手間は依存関係の閉包の大きさに比例し、gem の総数には依存しない。
+ */
+static void
+gemcut_closure_merge(int id, const bitmap_unit loaded[], bitmap_unit want[])
+{
+  const uint32_t *p = mgems_closure_ids + mgems_closure_offset[id];
+  const uint32_t *end = mgems_closure_ids + mgems_closure_offset[id + 1];
+  for (; p < end; p++) {
+    bitmap_unit bit = (bitmap_unit)1 << (*p % MGEMS_UNIT_BITS);
+    want[*p / MGEMS_UNIT_BITS] |= bit & ~loaded[*p / MGEMS_UNIT_BITS];
+  }
+}
+
+/*
+ * name に一致する gem と、その依存関係にある gem のうち未初期化のものを want に加えます。
+ * 成功した場合は nil を、失敗した場合は例外オブジェクトを返します (mrb->jmp があれば例外を発生させます)。
+ */
+static mrb_value
+gemcut_require_pickup(mrb_state *mrb, const struct gemcut *gcut, const char *name, bitmap_unit want[])
+{
+  int id = gemcut_lookup(name, TRUE);
+  if (id < 0) {
+    return gemcut_load_error(mrb, name);
+  }
+
+  if (gemcut_loaded_p_by_id(gcut, id)) {
+    return mrb_nil_value();
+  }
+
+  const struct mgem_spec *spec = &mgems_list[id];
+  if (!spec->available) {
+    return gemcut_load_error(mrb, spec->name);
+  }
+
+  gemcut_closure_merge(id, gcut->loaded, want);
+
+  return mrb_nil_value();
+}
+
+/*
+ * want に含まれる gem を、ひとつの保護区間と GC アリーナのスナップショットの中でまとめて初期化します。
+ */
+static mrb_value
+gemcut_require_commit(mrb_state *mrb, struct gemcut *gcut, const bitmap_unit want[])
+{
+  bitmap_unit any = 0;
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    any |= want[u];
+  }
+
+  if (any == 0) {
+    return mrb_false_value();
+  }
+
+  bool defer_gc = gcut->defer_gc && !mrb->gc.disabled;
+  if (defer_gc) {
+    mrb->gc.disabled = TRUE;
+  }
+
+  struct gemcut_require_bitmap_main_top args = { gcut, want };
+  int arenabase = gemcut_snapshot_gc_arena(mrb, gcut);
+  int probe = gemcut_stats_owner(gcut);
+  mrb_bool error;
+  mrb_value ret = mrb_protect_error(mrb, gemcut_require_bitmap_main_top, &args, &error);
+  if (error) {
+    gemcut_stats_cancel(mrb, gcut, probe);
+    gemcut_memreport_cancel(gcut);
+  }
+  gemcut_rollback_gc_arena(mrb, gcut, arenabase);
+
+  if (defer_gc) {
+    mrb->gc.disabled = FALSE;
+    if (error) {
+      mrb_gc_protect(mrb, ret);
+    }
+    mrb_full_gc(mrb);
+  }
+
+  if (error && mrb->jmp) {
+    mrb_exc_raise(mrb, ret);
+  }
+
+  return ret;
+}
+
+struct gemcut_require_many
+{
+  const char *const *names;
+  size_t num;
+};
+
+static mrb_value
+gemcut_require_many_main(mrb_state *mrb, void *opaque)
+{
+  struct gemcut *gcut = get_gemcut(mrb);
+
+  if (gcut->status) {
+    gemcut_sealed_error(mrb);
+  }
+
+  const struct gemcut_require_many *p = (const struct gemcut_require_many *)opaque;
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  for (size_t i = 0; i < p->num; i++) {
+    mrb_value err = gemcut_require_pickup(mrb, gcut, p->names[i], want);
+    if (!mrb_nil_p(err)) {
+      return err;
+    }
+  }
+
+  return gemcut_require_commit(mrb, gcut, want);
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    static mrb_value gemcut_require_many_protect(mrb_state *mrb, struct gemcut_require_many *args),
+    gemcut_require_many_main, args, RESULT_PASSTHROUGH, ret)
+
+MRB_API mrb_value
+mruby_gemcut_require(mrb_state *mrb, const char *name)
+{
+  struct gemcut_require_many args = { &name, 1 };
+  return gemcut_require_many_protect(mrb, &args);
+}
+
+MRB_API mrb_value
+mruby_gemcut_require_many(mrb_state *mrb, const char *const names[], size_t num)
+{
+  struct gemcut_require_many args = { names, num };
+  return gemcut_require_many_protect(mrb, &args);
+}
+
+static mrb_value
+gemcut_s_require(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  const char *name;
+  const mrb_value *argv;
+  mrb_int argc;
+  mrb_get_args(mrb, "z*", &name, &argv, &argc);
+
+  struct gemcut *gcut = get_gemcut(mrb);
+  if (gcut->status) {
+    gemcut_sealed_error(mrb);
+  }
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  gemcut_require_pickup(mrb, gcut, name, want);
+  for (; argc > 0; argc--, argv++) {
+    mrb_value v = *argv;
+    gemcut_require_pickup(mrb, gcut, mrb_string_value_cstr(mrb, &v), want);
+  }
+
+  return gemcut_require_commit(mrb, gcut, want);
+}
+
+/*
+ * srcmap にあって dest で未初期化の gem をまとめて初期化します。
+ */
+static mrb_value
+gemcut_imitate_bitmap_main(mrb_state *dest, void *opaque)
+{
+  const bitmap_unit *srcmap = (const bitmap_unit *)opaque;
+  struct gemcut *gdest = get_gemcut(dest);
+  if (gdest->status != gemcut_normal) {
+    gemcut_sealed_error(dest);
+  }
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS];
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    want[u] = srcmap[u] & ~gdest->loaded[u];
+  }
+
+  mrb_value ret = gemcut_require_commit(dest, gdest, want);
+  return mrb_exception_p(ret) ? ret : mrb_nil_value();
+}
+
+static mrb_value
+gemcut_imitate_to_main(mrb_state *dest, void *opaque)
+{
+  mrb_state *src = (mrb_state *)opaque;
+  const struct gemcut *gsrc = get_gemcut(src);
+  return gemcut_imitate_bitmap_main(dest, (void *)(uintptr_t)gsrc->loaded);
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_imitate_to(mrb_state *mrb, mrb_state *src),
+    gemcut_imitate_to_main, src, RESULT_PASSTHROUGH, ret)
+
+MRB_API int
+mruby_gemcut_imitate_to_many(mrb_state *dests[], size_t num, mrb_state *src)
+{
+  const struct gemcut *gsrc = get_gemcut_noraise(src);
+  if (gsrc == NULL) {
+    return (int)num;
+  }
+
+  bitmap_unit srcmap[MGEMS_BITMAP_UNITS];
+  memcpy(srcmap, gsrc->loaded, sizeof(srcmap));
+
+  int failures = 0;
+  for (; num > 0; num--, dests++) {
+    mrb_state *dest = *dests;
+    if (dest == NULL || dest == src) {
+      continue;
+    }
+
+    mrb_bool error;
+    mrb_value ret = mrb_protect_error(dest, gemcut_imitate_bitmap_main, srcmap, &error);
+    if (error || mrb_exception_p(ret)) {
+      dest->exc = mrb_obj_ptr(ret);
+      failures++;
+    }
+  }
+
+  return failures;
+}
+
+static int
+gemcut_profile_lookup(const char *name)
+{
+#if MGEMS_PROFILES > 0
+  for (int i = 0; i < MGEMS_PROFILES; i++) {
+    if (strcmp(name, mgems_profile_names[i]) == 0) {
+      return i;
+    }
+  }
+#else
+  (void)name;
+#endif
+
+  return -1;
+}
+
+static mrb_value
+gemcut_require_profile_main(mrb_state *mrb, void *opaque)
+{
+  struct gemcut *gcut = get_gemcut(mrb);
+
+  if (gcut->status) {
+    gemcut_sealed_error(mrb);
+  }
+
+  const char *name = (const char *)opaque;
+  int profile = gemcut_profile_lookup(name);
+  if (profile < 0) {
+    return gemcut_load_error_fmt(mrb, "no such gem profile - %" AUX_PRIs, name);
+  }
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+#if MGEMS_PROFILES > 0
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    want[u] = mgems_profile_closure[profile][u] & ~gcut->loaded[u];
+  }
+#endif
+
+  return gemcut_require_commit(mrb, gcut, want);
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_require_profile(mrb_state *mrb, const char *name),
+    gemcut_require_profile_main, name, RESULT_PASSTHROUGH, ret)
+
+#if MGEMS_PROFILES > 0
+struct gemcut_profile_progress
+{
+  struct gemcut *gcut;
+  int top; /* プロファイルの gem を記録簿に載せる位置 */
+};
+
+struct gemcut_profile_init
+{
+  int profile;
+  void (*body)(mrb_state *mrb, struct gemcut_profile_progress *progress);
+  struct gemcut_profile_progress progress;
+};
+
+/*
+ * deps.h に生成された関数から、gem_init の前に呼び出される。
+ * 通常の方法と同じく、gem_init の前に初期化済みの印を付ける。
+ * gem_init の中から require された gem はその時点で通常の方法で初期化されるため、false を返して飛ばさせる。
+ */
+static bool
+gemcut_profile_enter(struct gemcut_profile_progress *progress, int id)
+{
+  if (gemcut_loaded_p_by_id(progress->gcut, id)) {
+    return false;
+  }
+
+  gemcut_set_loaded_by_id(progress->gcut, id);
+  return true;
+}
+
+/*
+ * deps.h に生成された関数から、gem_init を終えるたびに呼び出される。
+ * gem_init の中から require された gem はその時点で記録簿の末尾に載るため、その手前に挿入する。
+ */
+static void
+gemcut_profile_done(struct gemcut_profile_progress *progress, int id)
+{
+  if (gemcut_journal_insert(progress->gcut, progress->top, id)) {
+    progress->top++;
+  }
+  gemcut_mrblib_count(id);
+}
+
+static mrb_value
+gemcut_profile_body_main(mrb_state *mrb, void *opaque)
+{
+  struct gemcut_profile_init *p = (struct gemcut_profile_init *)opaque;
+  p->body(mrb, &p->progress);
+  return mrb_nil_value();
+}
+
+/*
+ * gem ごとに記録するもの (フック、統計情報、メモリの報告、予算) が有効であれば true を返す。
+ * 生成された関数はこれらを扱わないため、その場合は通常の方法に任せる。
+ */
+static bool
+gemcut_per_gem_p(const struct gemcut *gcut)
+{
+#if defined(MRUBY_GEMCUT_ENABLE_STATS) || defined(MRUBY_GEMCUT_ENABLE_MEMORY_REPORT)
+  (void)gcut;
+  return true;
+#else
+  if (gcut->hooks.active) {
+    return true;
+  }
+# ifdef GEMCUT_HAVE_VMSNAP
+  if (gcut->budget.active) {
+    return true;
+  }
+# endif
+  return false;
+#endif
+}
+
+/*
+ * deps.h に生成された mruby_gemcut_init_<profile>() の本体。
+ * プロファイルの gem がひとつも初期化されていなければ、生成された関数で直接 gem_init を呼び出す。
+ * 一部でも初期化済みであれば、依存関係をたどる通常の方法に任せる。
+ */
+static mrb_value
+gemcut_profile_init_main(mrb_state *mrb, void *opaque)
+{
+  struct gemcut_profile_init *p = (struct gemcut_profile_init *)opaque;
+  struct gemcut *gcut = get_gemcut(mrb);
+
+  if (gcut->status) {
+    gemcut_sealed_error(mrb);
+  }
+
+  if (gemcut_per_gem_p(gcut)) {
+    return gemcut_require_profile_main(mrb, (void *)(uintptr_t)mgems_profile_names[p->profile]);
+  }
+
+  const bitmap_unit *closure = mgems_profile_closure[p->profile];
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    if (gcut->loaded[u] & closure[u]) {
+      return gemcut_require_profile_main(mrb, (void *)(uintptr_t)mgems_profile_names[p->profile]);
+    }
+  }
+
+  if (!gcut->set_atexit) {
+    mrb_state_atexit(mrb, gemcut_cleanup);
+    gcut->set_atexit = true;
+  }
+
+  p->progress.gcut = gcut;
+  p->progress.top = gcut->journal_len;
+
+  /*
+   * 印は gem ごとに付けるため、例外が発生した場合は通常の方法と同じく、
+   * 例外を発生させた gem までが初期化済みとなり (記録簿には載らない)、それより後の gem は初期化されていないままとなる。
+   */
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_bool error;
+  mrb_value exc = mrb_protect_error(mrb, gemcut_profile_body_main, p, &error);
+  if (error) {
+    mrb_exc_raise(mrb, exc);
+  }
+  mrb_gc_arena_restore(mrb, ai);
+
+  return mrb_true_value();
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    static mrb_value gemcut_profile_init_protect(mrb_state *mrb, struct gemcut_profile_init *args),
+    gemcut_profile_init_main, args, RESULT_PASSTHROUGH, ret)
+
+static mrb_value
+gemcut_profile_init(mrb_state *mrb, int profile, void (*body)(mrb_state *mrb, struct gemcut_profile_progress *progress))
+{
+  struct gemcut_profile_init args;
+  args.profile = profile;
+  args.body = body;
+  return gemcut_profile_init_protect(mrb, &args);
+}
+#endif
+
+static mrb_value
+gemcut_s_require_profile(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  const char *name;
+  mrb_get_args(mrb, "z", &name);
+  return gemcut_require_profile_main(mrb, (void *)(uintptr_t)name);
+}
+
+static int
+gemcut_autoload_lookup(const struct mgem_autoload list[], int num, const char *name)
+{
+  int lo = 0, hi = num;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(name, list[mid].name);
+    if (cmp == 0) {
+      return list[mid].id;
+    } else if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * sym を定義している gem が未初期化であれば初期化して true を返します。
+ * 封印されている場合や、ブラックリストに含まれる gem であれば何もしません。
+ */
+static bool
+gemcut_autoload_trigger(mrb_state *mrb, const struct mgem_autoload list[], int num, mrb_sym sym)
+{
+  struct gemcut *gcut = get_gemcut_noraise(mrb);
+  if (gcut == NULL || gcut->status != gemcut_normal) {
+    return false;
+  }
+
+  int id = gemcut_autoload_lookup(list, num, mrb_sym_name(mrb, sym));
+  if (id < 0 || gemcut_loaded_p_by_id(gcut, id) || !mgems_list[id].available) {
+    return false;
+  }
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  gemcut_closure_merge(id, gcut->loaded, want);
+  gemcut_require_commit(mrb, gcut, want);
+
+  return true;
+}
+
+static mrb_value
+gemcut_autoload_const_missing(mrb_state *mrb, mrb_value mod)
+{
+  mrb_sym name;
+  mrb_get_args(mrb, "n", &name);
+
+  /*
+   * 自動読み込みするのはトップレベルまで探される参照だけに限る。
+   * 修飾のない参照であれば mod は呼び出し元のクラスとなり、
+   * Foo::Name の形では Foo がモジュールの場合にのみ Object まで探される。
+   */
+  struct RClass *klass = mrb_class_ptr(mod);
+  mrb_value objclass = mrb_obj_value(mrb->object_class);
+  if ((klass == mrb->object_class || klass->tt == MRB_TT_MODULE || klass == aux_caller_target_class(mrb)) &&
+      gemcut_autoload_trigger(mrb, mgems_autoload_consts, MGEMS_AUTOLOAD_CONSTS, name) &&
+      mrb_const_defined_at(mrb, objclass, name)) {
+    return mrb_const_get(mrb, objclass, name);
+  }
+
+  mrb_value arg = mrb_symbol_value(name);
+  return mrb_funcall_argv(mrb, mod, mrb_intern_lit(mrb, "__gemcut_const_missing__"), 1, &arg);
+}
+
+static mrb_value
+gemcut_autoload_method_missing(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym name;
+  const mrb_value *argv;
+  mrb_int argc;
+  mrb_value block;
+  mrb_get_args(mrb, "n*&", &name, &argv, &argc, &block);
+
+  if (gemcut_autoload_trigger(mrb, mgems_autoload_methods, MGEMS_AUTOLOAD_METHODS, name) &&
+      mrb_obj_respond_to(mrb, mrb_class(mrb, self), name)) {
+    return mrb_funcall_with_block(mrb, self, name, argc, argv, block);
+  }
+
+  mrb_value args = mrb_ary_new_capa(mrb, argc + 1);
+  mrb_ary_push(mrb, args, mrb_symbol_value(name));
+  for (mrb_int i = 0; i < argc; i++) {
+    mrb_ary_push(mrb, args, argv[i]);
+  }
+
+  return mrb_funcall_with_block(mrb, self, mrb_intern_lit(mrb, "__gemcut_method_missing__"), RARRAY_LEN(args), RARRAY_PTR(args), block);
+}
+
+/*
+ * Module#const_missing と Object#method_missing を差し替えて、最初に参照された時点で gem を初期化させる。
+ * 元のメソッドは別名で残しておき、該当する gem がなければそちらに任せる。
+ */
+static mrb_value
+gemcut_autoload_main(mrb_state *mrb, void *opaque)
+{
+  (void)opaque;
+
+  struct gemcut *gcut = get_gemcut(mrb);
+  if (gcut->autoload) {
+    return mrb_nil_value();
+  }
+
+  /* 元のメソッドが mruby のバージョンによっては存在しないため、あるものだけを差し替える */
+  mrb_sym id_const_missing = mrb_intern_lit(mrb, "const_missing");
+  if (mrb_obj_respond_to(mrb, mrb->module_class, id_const_missing)) {
+    mrb_alias_method(mrb, mrb->module_class, mrb_intern_lit(mrb, "__gemcut_const_missing__"), id_const_missing);
+    mrb_define_method(mrb, mrb->module_class, "const_missing", gemcut_autoload_const_missing, MRB_ARGS_REQ(1));
+  }
+  mrb_sym id_method_missing = mrb_intern_lit(mrb, "method_missing");
+  if (mrb_obj_respond_to(mrb, mrb->object_class, id_method_missing)) {
+    mrb_alias_method(mrb, mrb->object_class, mrb_intern_lit(mrb, "__gemcut_method_missing__"), id_method_missing);
+    mrb_define_method(mrb, mrb->object_class, "method_missing", gemcut_autoload_method_missing, MRB_ARGS_ANY());
+  }
+  gcut->autoload = true;
+
+  return mrb_nil_value();
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_autoload(mrb_state *mrb),
+    gemcut_autoload_main, NULL, RESULT_PASSTHROUGH, ret)
+
+static mrb_value
+gemcut_s_autoload_all(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  gemcut_check_sealed(mrb);
+  return gemcut_autoload_main(mrb, NULL);
+}
+
+#ifdef GEMCUT_HAVE_VMSNAP
+/*
+ * 現在の gem の組み合わせと、クラス・モジュールの状態を sp に記録する。
+ * keeper_id は記録したオブジェクトを GC から守る配列を置くインスタンス変数の名前。
+ */
+static void
+gemcut_savepoint_take(mrb_state *mrb, struct gemcut *gcut, struct gemcut_savepoint *sp, mrb_sym keeper_id)
+{
+  struct gemcut_vmsnap *old = sp->vm;
+  sp->vm = NULL;
+  sp->ready = false;
+  gemcut_vmsnap_free(mrb, old);
+
+  mrb_value keeper = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, gcut->self, keeper_id, keeper);
+
+  /* 記録の途中で例外が発生しても解放できるよう、先に gcut へ繋いでおく */
+  sp->vm = gemcut_vmsnap_new(mrb, keeper);
+  gemcut_vmsnap_take(mrb, sp->vm);
+
+  memcpy(sp->loaded, gcut->loaded, sizeof(gcut->loaded));
+  sp->journal_len = gcut->journal_len;
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+  sp->numstats = gcut->numstats;
+#endif
+  sp->defined_module = gcut->defined_module;
+  sp->autoload = gcut->autoload;
+  sp->ready = true;
+}
+
+static void
+gemcut_savepoint_discard(mrb_state *mrb, struct gemcut *gcut, struct gemcut_savepoint *sp, mrb_sym keeper_id)
+{
+  struct gemcut_vmsnap *old = sp->vm;
+  sp->vm = NULL;
+  sp->ready = false;
+  gemcut_vmsnap_free(mrb, old);
+
+  mrb_iv_set(mrb, gcut->self, keeper_id, mrb_nil_value());
+}
+
+/*
+ * sp より後に初期化を終えた gem の gem_final を逆順に呼び出してから、
+ * クラス・モジュールの状態を sp の時点に書き戻す。
+ * 初期化の途中で例外が発生した gem は記録簿に載っていないため、gem_final は呼び出されない。
+ */
+static void
+gemcut_savepoint_restore(mrb_state *mrb, struct gemcut *gcut, const struct gemcut_savepoint *sp)
+{
+  gemcut_finalize_journal(mrb, gcut, sp->journal_len);
+
+  gcut->loaded_count = 0;
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+    for (bitmap_unit bits = gcut->loaded[u] & ~sp->loaded[u]; bits != 0; bits &= bits - 1) {
+      gcut->objects[u * MGEMS_UNIT_BITS + ctz64(bits)] = 0;
+    }
+#endif
+    gcut->loaded[u] = sp->loaded[u];
+    gcut->loaded_count += popcount64(gcut->loaded[u]);
+  }
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+  /* 統計情報は初期化を終えた順に並ぶため、巻き戻した gem の分は末尾にある */
+  gcut->numstats = sp->numstats;
+#endif
+  gcut->features = mrb_nil_value();
+
+  gemcut_vmsnap_restore(mrb, sp->vm);
+  gcut->defined_module = sp->defined_module;
+  gcut->autoload = sp->autoload;
+  mrb->exc = NULL;
+
+  /* 巻き戻した gem が作ったオブジェクトを回収する */
+  mrb_full_gc(mrb);
+}
+#endif
+
+/*
+ * 現在の gem の組み合わせと、クラス・モジュールの状態を記録する。
+ * すでに記録していた場合は置き換える。
+ */
+static mrb_value
+gemcut_checkpoint_main(mrb_state *mrb, void *opaque)
+{
+  (void)opaque;
+
+  struct gemcut *gcut = get_gemcut(mrb);
+  if (gcut->status != gemcut_normal) {
+    gemcut_sealed_error(mrb);
+  }
+
+#ifdef GEMCUT_HAVE_VMSNAP
+  gemcut_savepoint_take(mrb, gcut, &gcut->checkpoint, id_checkpoint);
+
+  return mrb_true_value();
+#else
+  mrb_raise(mrb, mrb_exc_get(mrb, "NotImplementedError"), "checkpoint is not supported in this mruby");
+  return mrb_nil_value();
+#endif
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_checkpoint(mrb_state *mrb),
+    gemcut_checkpoint_main, NULL, RESULT_PASSTHROUGH, ret)
+
+/*
+ * チェックポイント以降に初期化された gem の gem_final を番号の降順に呼び出してから、
+ * クラス・モジュールの状態をチェックポイントの時点に書き戻す。
+ * チェックポイントは残しておくため、何度でも巻き戻せる。
+ */
+static mrb_value
+gemcut_rollback_main(mrb_state *mrb, void *opaque)
+{
+  (void)opaque;
+
+  struct gemcut *gcut = get_gemcut(mrb);
+  if (gcut->status != gemcut_normal) {
+    gemcut_sealed_error(mrb);
+  }
+
+#ifdef GEMCUT_HAVE_VMSNAP
+  if (!gcut->checkpoint.ready) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no checkpoint");
+  }
+
+  gemcut_savepoint_restore(mrb, gcut, &gcut->checkpoint);
+
+  return mrb_true_value();
+#else
+  mrb_raise(mrb, mrb_exc_get(mrb, "NotImplementedError"), "rollback is not supported in this mruby");
+  return mrb_nil_value();
+#endif
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_rollback(mrb_state *mrb),
+    gemcut_rollback_main, NULL, RESULT_PASSTHROUGH, ret)
+
+#ifdef GEMCUT_HAVE_VMSNAP
+static mrb_value
+gemcut_budget_error(mrb_state *mrb, const struct gemcut *gcut, mrb_value cause)
+{
+  int id = gcut->budget.current;
+  if (id < 0) {
+    return cause; /* gem_init 以外で失敗した */
+  }
+
+  const char *name = mgems_list[id].name;
+  mrb_value mesg;
+  if (gcut->budget.timeout) {
+    mesg = mrb_format(mrb, "%" AUX_PRIs " - exceeded the time budget", AUX_PRIs_MAKE(name));
+  } else if (gcut->budget.exceeded) {
+    mesg = mrb_format(mrb, "%" AUX_PRIs " - exceeded the memory budget", AUX_PRIs_MAKE(name));
+  } else {
+    mesg = mrb_format(mrb, "%" AUX_PRIs " - ", AUX_PRIs_MAKE(name));
+    mrb_str_cat_str(mrb, mesg, mrb_inspect(mrb, cause));
+  }
+
+  return mrb_exc_new_str(mrb, mrb_exc_get(mrb, "LoadError"), mesg);
+}
+#endif
+
+struct gemcut_require_with_budget
+{
+  const char *name;
+  uint64_t max_ns;
+  size_t max_bytes;
+};
+
+/*
+ * name とその依存関係を予算の範囲内でまとめて初期化する。
+ * 途中で失敗したり予算を超えたりした場合は、初期化した gem を全て巻き戻してから例外オブジェクトを返す。
+ */
+static mrb_value
+gemcut_require_with_budget_main(mrb_state *mrb, void *opaque)
+{
+  const struct gemcut_require_with_budget *p = (const struct gemcut_require_with_budget *)opaque;
+  struct gemcut *gcut = get_gemcut(mrb);
+
+  if (gcut->status) {
+    gemcut_sealed_error(mrb);
+  }
+
+#ifdef GEMCUT_HAVE_VMSNAP
+  if (gcut->budget.active) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "mruby_gemcut_require_with_budget() is not reentrant");
+  }
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  mrb_value err = gemcut_require_pickup(mrb, gcut, p->name, want);
+  if (!mrb_nil_p(err)) {
+    return err;
+  }
+
+  bitmap_unit any = 0;
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    any |= want[u];
+  }
+
+  if (any == 0) {
+    return mrb_false_value();
+  }
+
+  gemcut_savepoint_take(mrb, gcut, &gcut->txn, id_transaction);
+
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+  /* 追跡用の allocf は外すことがないため、予算の allocf より内側に置いておく */
+  if (gcut->memtrack == NULL) {
+    gcut->memtrack = gemcut_memtrack_attach(mrb, MGEMS_POPULATION);
+  }
+#endif
+
+  struct gemcut_require_bitmap_main_top args = { gcut, want };
+  int arenabase = gemcut_snapshot_gc_arena(mrb, gcut);
+  int probe = gemcut_stats_owner(gcut);
+  mrb_bool error = TRUE;
+  mrb_value ret = mrb_obj_value(mrb->nomem_err);
+  if (gemcut_budget_begin(mrb, gcut, p->max_ns, p->max_bytes)) {
+    ret = mrb_protect_error(mrb, gemcut_require_bitmap_main_top, &args, &error);
+    /* allocf は包んだ順とは逆に外す */
+    if (error) {
+      gemcut_stats_cancel(mrb, gcut, probe);
+      gemcut_memreport_cancel(gcut);
+    }
+    gemcut_budget_end(mrb, gcut);
+  }
+  gemcut_rollback_gc_arena(mrb, gcut, arenabase);
+
+  if (error) {
+    mrb_gc_protect(mrb, ret);
+    gemcut_savepoint_restore(mrb, gcut, &gcut->txn);
+    ret = gemcut_budget_error(mrb, gcut, ret);
+  }
+
+  gemcut_savepoint_discard(mrb, gcut, &gcut->txn, id_transaction);
+
+  if (error && mrb->jmp) {
+    mrb_exc_raise(mrb, ret);
+  }
+
+  return ret;
+#else
+  (void)p;
+  mrb_raise(mrb, mrb_exc_get(mrb, "NotImplementedError"), "require_with_budget is not supported in this mruby");
+  return mrb_nil_value();
+#endif
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    static mrb_value gemcut_require_with_budget_protect(mrb_state *mrb, struct gemcut_require_with_budget *args),
+    gemcut_require_with_budget_main, args, RESULT_PASSTHROUGH, ret)
+
+MRB_API mrb_value
+mruby_gemcut_require_with_budget(mrb_state *mrb, const char *name, uint64_t max_ns, size_t max_bytes)
+{
+  struct gemcut_require_with_budget args = { name, max_ns, max_bytes };
+  return gemcut_require_with_budget_protect(mrb, &args);
+}
+
+static mrb_value
+gemcut_defer_gc_main(mrb_state *mrb, void *opaque)
+{
+  get_gemcut(mrb)->defer_gc = (opaque != NULL);
+  return mrb_nil_value();
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API void mruby_gemcut_defer_gc(mrb_state *mrb, mrb_bool defer),
+    gemcut_defer_gc_main, defer, RESULT_VOID, RESULT_VOID_ERROR)
+
+struct gemcut_set_hooks
+{
+  mruby_gemcut_hook_f *before;
+  mruby_gemcut_hook_f *after;
+  void *ud;
+};
+
+static mrb_value
+gemcut_set_hooks_main(mrb_state *mrb, void *opaque)
+{
+  const struct gemcut_set_hooks *p = (const struct gemcut_set_hooks *)opaque;
+  struct gemcut *gcut = get_gemcut(mrb);
+  gcut->hooks.before = p->before;
+  gcut->hooks.after = p->after;
+  gcut->hooks.ud = p->ud;
+  gcut->hooks.active = (p->before != NULL || p->after != NULL);
+  return mrb_nil_value();
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    static void gemcut_set_hooks_protect(mrb_state *mrb, struct gemcut_set_hooks *args),
+    gemcut_set_hooks_main, args, RESULT_VOID, RESULT_VOID_ERROR)
+
+MRB_API void
+mruby_gemcut_set_hooks(mrb_state *mrb, mruby_gemcut_hook_f *before, mruby_gemcut_hook_f *after, void *ud)
+{
+  struct gemcut_set_hooks args = { before, after, ud };
+  gemcut_set_hooks_protect(mrb, &args);
+}
+
+static mrb_value
+gemcut_loaded_features_main(mrb_state *mrb, void *opaque)
+{
+  (void)opaque;
+
+  struct gemcut *gcut = get_gemcut(mrb);
+  if (!mrb_nil_p(gcut->features)) {
+    return gcut->features;
+  }
+
+  mrb_value ary = mrb_ary_new_capa(mrb, gcut->loaded_count);
+  int ai = mrb_gc_arena_save(mrb);
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    for (bitmap_unit bits = gcut->loaded[u]; bits != 0; bits &= bits - 1) {
+      const char *name = mgems_list[u * MGEMS_UNIT_BITS + ctz64(bits)].name;
+      mrb_value str = mrb_str_new_static(mrb, name, strlen(name));
+      mrb_obj_freeze(mrb, str);
+      mrb_ary_push(mrb, ary, str);
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  }
+  mrb_obj_freeze(mrb, ary);
+
+  mrb_iv_set(mrb, gcut->self, id_features, ary);
+  gcut->features = ary;
+
+  return ary;
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_loaded_features(mrb_state *mrb),
+    gemcut_loaded_features_main, NULL, RESULT_PASSTHROUGH, mrb_nil_value())
+
+static mrb_value
+gemcut_s_loaded_features(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  gemcut_check_sealed(mrb);
+  return gemcut_loaded_features_main(mrb, NULL);
+}
+
+static mrb_value
+gemcut_loaded_count_main(mrb_state *mrb, void *opaque)
+{
+  struct gemcut *gcut = get_gemcut(mrb);
+  int count = gcut->loaded_count;
+
+  if (opaque) {
     *(int *)opaque = count;
   }
 
-  return mrb_fixnum_value(count);
+  return mrb_fixnum_value(count);
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API int mruby_gemcut_loaded_count(mrb_state *mrb),
+    gemcut_loaded_count_main, NULL, mrb_fixnum, -1)
+
+static mrb_value
+gemcut_s_loaded_feature_count(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  gemcut_check_sealed(mrb);
+  return gemcut_loaded_count_main(mrb, NULL);
+}
+
+static mrb_value
+gemcut_loaded_feature_p_main(mrb_state *mrb, void *opaque)
+{
+  struct gemcut *gcut = get_gemcut(mrb);
+  int id = gemcut_lookup((const char *)opaque, TRUE);
+  return mrb_bool_value(gemcut_loaded_p_by_id(gcut, id));
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_bool mruby_gemcut_loaded_p(mrb_state *mrb, const char *name),
+    gemcut_loaded_feature_p_main, (void *)(uintptr_t)name, mrb_bool, FALSE)
+
+static mrb_value
+gemcut_s_loaded_feature_p(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  const char *name;
+  mrb_get_args(mrb, "z", &name);
+  gemcut_check_sealed(mrb);
+  return gemcut_loaded_feature_p_main(mrb, (void *)(uintptr_t)name);
+}
+
+static mrb_value
+gemcut_loadable_features_main(mrb_state *mrb, void *opaque)
+{
+  (void)opaque;
+  (void)get_gemcut(mrb);
+
+  mrb_value ary = mrb_ary_new(mrb);
+  FOREACH_ALIST(const struct mgem_spec, *mgem, mgems_list) {
+    if (mgem->available) {
+      mrb_ary_push(mrb, ary, mrb_str_new_static(mrb, mgem->name, strlen(mgem->name)));
+    }
+  }
+
+  return ary;
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_loadable_features(mrb_state *mrb),
+    gemcut_loadable_features_main, NULL, RESULT_PASSTHROUGH, mrb_nil_value())
+
+static mrb_value
+gemcut_s_loadable_features(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  gemcut_check_sealed(mrb);
+  return gemcut_loadable_features_main(mrb, NULL);
+}
+
+static mrb_value
+gemcut_loadable_feature_count_main(mrb_state *mrb, void *opaque)
+{
+  (void)opaque;
+  (void)get_gemcut(mrb);
+
+  int count = 0;
+  FOREACH_ALIST(const struct mgem_spec, *mgem, mgems_list) {
+    count += mgem->available;
+  }
+  return mrb_fixnum_value(count);
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API int mruby_gemcut_loadable_count(mrb_state *mrb),
+    gemcut_loadable_feature_count_main, NULL, mrb_fixnum, -1)
+
+static mrb_value
+gemcut_s_loadable_feature_count(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  gemcut_check_sealed(mrb);
+  return gemcut_loadable_feature_count_main(mrb, NULL);
+}
+
+static mrb_value
+gemcut_loadable_feature_p_main(mrb_state *mrb, void *opaque)
+{
+  (void)get_gemcut(mrb);
+
+  const char *name = (const char *)opaque;
+  int id = gemcut_lookup(name, TRUE);
+  if (id >= 0 && mgems_list[id].available) {
+    return mrb_true_value();
+  } else {
+    return mrb_false_value();
+  }
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_bool mruby_gemcut_loadable_p(mrb_state *mrb, const char *name),
+    gemcut_loadable_feature_p_main, (void *)(uintptr_t)name, mrb_bool, FALSE)
+
+static mrb_value
+gemcut_s_loadable_feature_p(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  const char *name;
+  mrb_get_args(mrb, "z", &name);
+  gemcut_check_sealed(mrb);
+  return gemcut_loadable_feature_p_main(mrb, (void *)(uintptr_t)name);
+}
+
+static void
+gemcut_push_name(mrb_state *mrb, mrb_value ary, int id)
+{
+  const char *name = mgems_list[id].name;
+  mrb_ary_push(mrb, ary, mrb_str_new_static(mrb, name, strlen(name)));
+}
+
+/*
+ * name が直接依存する gem の名前の配列を返す
+ */
+static mrb_value
+gemcut_dependencies_main(mrb_state *mrb, void *opaque)
+{
+  (void)get_gemcut(mrb);
+
+  const char *name = (const char *)opaque;
+  int id = gemcut_lookup(name, TRUE);
+  if (id < 0) {
+    return gemcut_load_error(mrb, name);
+  }
+
+  const struct mgem_spec *spec = &mgems_list[id];
+  mrb_value ary = mrb_ary_new_capa(mrb, spec->numdeps);
+  int ai = mrb_gc_arena_save(mrb);
+  for (uint32_t i = 0; i < spec->numdeps; i++) {
+    gemcut_push_name(mrb, ary, (int)spec->deps[i]);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return ary;
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_dependencies(mrb_state *mrb, const char *name),
+    gemcut_dependencies_main, name, RESULT_PASSTHROUGH, ret)
+
+/*
+ * name に直接依存する gem の名前の配列を返す。
+ * 逆引きの表は持たないため、全ての gem の依存関係を調べる。
+ */
+static mrb_value
+gemcut_dependents_main(mrb_state *mrb, void *opaque)
+{
+  (void)get_gemcut(mrb);
+
+  const char *name = (const char *)opaque;
+  int id = gemcut_lookup(name, TRUE);
+  if (id < 0) {
+    return gemcut_load_error(mrb, name);
+  }
+
+  mrb_value ary = mrb_ary_new(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+  /* 依存する側は常に番号が大きい */
+  for (int i = id + 1; i < MGEMS_POPULATION; i++) {
+    const struct mgem_spec *spec = &mgems_list[i];
+    for (uint32_t j = 0; j < spec->numdeps; j++) {
+      if (spec->deps[j] == (uint32_t)id) {
+        gemcut_push_name(mrb, ary, i);
+        mrb_gc_arena_restore(mrb, ai);
+        break;
+      }
+    }
+  }
+
+  return ary;
+}
+
+DEFINE_PROTECTED_FUNCTION(
+    MRB_API mrb_value mruby_gemcut_dependents(mrb_state *mrb, const char *name),
+    gemcut_dependents_main, name, RESULT_PASSTHROUGH, ret)
+
+struct gemcut_closure
+{
+  const char *name;
+  mrb_bool exclude_loaded;
+};
+
+/*
+ * name を require した場合に初期化される gem の名前を、初期化される順に並べた配列を返す。
+ * exclude_loaded が偽であれば、初期化済みのものも含める。
+ */
+static mrb_value
+gemcut_closure_main(mrb_state *mrb, void *opaque)
+{
+  const struct gemcut_closure *p = (const struct gemcut_closure *)opaque;
+  const struct gemcut *gcut = get_gemcut(mrb);
+
+  int id = gemcut_lookup(p->name, TRUE);
+  if (id < 0) {
+    return gemcut_load_error(mrb, p->name);
+  }
+
+  const uint32_t *ids = mgems_closure_ids + mgems_closure_offset[id];
+  int num = (int)(mgems_closure_offset[id + 1] - mgems_closure_offset[id]);
+  mrb_value ary = mrb_ary_new_capa(mrb, num);
+  int ai = mrb_gc_arena_save(mrb);
+  for (int i = 0; i < num; i++) {
+    if (p->exclude_loaded && gemcut_loaded_p_by_id(gcut, (int)ids[i])) {
+      continue;
+    }
+
+    gemcut_push_name(mrb, ary, (int)ids[i]);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return ary;
 }
 
 DEFINE_PROTECTED_FUNCTION(
-    MRB_API int mruby_gemcut_loaded_count(mrb_state *mrb),
-    gemcut_loaded_count_main, NULL, mrb_fixnum, -1)
+    static mrb_value gemcut_closure_protect(mrb_state *mrb, struct gemcut_closure *args),
+    gemcut_closure_main, args, RESULT_PASSTHROUGH, ret)
+
+MRB_API mrb_value
+mruby_gemcut_closure(mrb_state *mrb, const char *name, mrb_bool exclude_loaded)
+{
+  struct gemcut_closure args = { name, exclude_loaded };
+  return gemcut_closure_protect(mrb, &args);
+}
 
 static mrb_value
-gemcut_s_loaded_feature_count(mrb_state *mrb, mrb_value mod)
+gemcut_s_dependencies(mrb_state *mrb, mrb_value mod)
 {
   (void)mod;
 
+  const char *name;
+  mrb_get_args(mrb, "z", &name);
   gemcut_check_sealed(mrb);
-  return gemcut_loaded_count_main(mrb, NULL);
+  return gemcut_dependencies_main(mrb, (void *)(uintptr_t)name);
 }
 
 static mrb_value
-gemcut_loaded_feature_p_main(mrb_state *mrb, void *opaque)
+gemcut_s_dependents(mrb_state *mrb, mrb_value mod)
 {
-  struct gemcut *gcut = get_gemcut(mrb);
-  int id = gemcut_lookup(mrb, (const char *)opaque, TRUE);
-  return mrb_bool_value(gemcut_loaded_p_by_id(gcut, id));
+  (void)mod;
+
+  const char *name;
+  mrb_get_args(mrb, "z", &name);
+  gemcut_check_sealed(mrb);
+  return gemcut_dependents_main(mrb, (void *)(uintptr_t)name);
+}
+
+/*
+ * Gemcut.closure(name, exclude_loaded: true)
+ *
+ * mruby-2.x でも使えるように、キーワード引数は最後のハッシュとして受け取る
+ */
+static mrb_value
+gemcut_s_closure(mrb_state *mrb, mrb_value mod)
+{
+  (void)mod;
+
+  struct gemcut_closure args = { NULL, TRUE };
+  mrb_value opts = mrb_nil_value();
+  mrb_get_args(mrb, "z|H", &args.name, &opts);
+  gemcut_check_sealed(mrb);
+
+  if (!mrb_nil_p(opts)) {
+    mrb_value v = mrb_hash_fetch(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "exclude_loaded")), mrb_true_value());
+    args.exclude_loaded = mrb_test(v);
+  }
+
+  return gemcut_closure_main(mrb, &args);
+}
+
+/*
+ * フィンガープリントは "ビルドの識別子-ビットマップ" の形の文字列で、いずれも小文字の 16 進数で表す。
+ * ビルドの識別子は 8 桁固定で、ビットマップは番号 0 の gem から 4 つずつを 1 桁とし、末尾の 0 を省く。
+ *
+ *      d269c0cf-81
+ */
+#define GEMCUT_FINGERPRINT_HEAD 9 /* ビルドの識別子と "-" の長さ */
+
+enum gemcut_fingerprint_status {
+  gemcut_fingerprint_ok = 0,
+  gemcut_fingerprint_invalid = 1,
+  gemcut_fingerprint_foreign = 2,
+};
+
+static const char gemcut_hexdigits[] = "0123456789abcdef";
+
+static int
+gemcut_hexvalue(char c)
+{
+  if (c >= '0' && c <= '9') { return c - '0'; }
+  if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+  return -1;
+}
+
+/*
+ * loaded のフィンガープリントを buf に書き込み、終端の NUL を除いた長さを返す。
+ * size が足りなければ切り詰めるが、戻り値は切り詰める前の長さとなる (snprintf() と同じ)。
+ */
+static size_t
+gemcut_fingerprint_encode(const bitmap_unit loaded[], char buf[], size_t size)
+{
+  size_t nibbles = 0;
+  for (int u = MGEMS_BITMAP_UNITS - 1; u >= 0; u--) {
+    if (loaded[u] != 0) {
+      nibbles = (size_t)u * (MGEMS_UNIT_BITS / 4) + (size_t)msb64(loaded[u]) / 4 + 1;
+      break;
+    }
+  }
+
+  size_t len = GEMCUT_FINGERPRINT_HEAD + nibbles;
+  if (size == 0) {
+    return len;
+  }
+
+  size_t i;
+  for (i = 0; i < len && i + 1 < size; i++) {
+    if (i < GEMCUT_FINGERPRINT_HEAD - 1) {
+      buf[i] = gemcut_hexdigits[(MGEMS_BUILD_ID >> ((GEMCUT_FINGERPRINT_HEAD - 2 - i) * 4)) & 0x0f];
+    } else if (i == GEMCUT_FINGERPRINT_HEAD - 1) {
+      buf[i] = '-';
+    } else {
+      size_t n = i - GEMCUT_FINGERPRINT_HEAD;
+      bitmap_unit unit = loaded[n / (MGEMS_UNIT_BITS / 4)];
+      buf[i] = gemcut_hexdigits[(unit >> (n % (MGEMS_UNIT_BITS / 4) * 4)) & 0x0f];
+    }
+  }
+  buf[i] = '\0';
+
+  return len;
+}
+
+static enum gemcut_fingerprint_status
+gemcut_fingerprint_decode(const char *fp, bitmap_unit set[])
+{
+  uint32_t id = 0;
+  for (int i = 0; i < GEMCUT_FINGERPRINT_HEAD - 1; i++) {
+    int v = gemcut_hexvalue(fp[i]);
+    if (v < 0) {
+      return gemcut_fingerprint_invalid;
+    }
+    id = (id << 4) | (uint32_t)v;
+  }
+
+  if (fp[GEMCUT_FINGERPRINT_HEAD - 1] != '-') {
+    return gemcut_fingerprint_invalid;
+  }
+
+  if (id != MGEMS_BUILD_ID) {
+    return gemcut_fingerprint_foreign;
+  }
+
+  memset(set, 0, sizeof(bitmap_unit) * MGEMS_BITMAP_UNITS);
+  const char *p = fp + GEMCUT_FINGERPRINT_HEAD;
+  for (size_t n = 0; p[n] != '\0'; n++) {
+    int v = gemcut_hexvalue(p[n]);
+    if (v < 0) {
+      return gemcut_fingerprint_invalid;
+    }
+
+    /* 書き出す側は末尾の 0 を取り除くため、収まらない桁があれば 0 であっても不正とする */
+    if (n >= (size_t)MGEMS_BITMAP_UNITS * (MGEMS_UNIT_BITS / 4)) {
+      return gemcut_fingerprint_invalid;
+    }
+
+    /* 存在しない番号の gem が含まれていれば、別のビルドのものとみなす */
+    if (v != 0 && n * 4 + (size_t)msb64((uint64_t)v) >= MGEMS_POPULATION) {
+      return gemcut_fingerprint_foreign;
+    }
+
+    set[n / (MGEMS_UNIT_BITS / 4)] |= (bitmap_unit)v << (n % (MGEMS_UNIT_BITS / 4) * 4);
+  }
+
+  return gemcut_fingerprint_ok;
+}
+
+struct gemcut_fingerprint
+{
+  char *buf;
+  size_t size;
+};
+
+static mrb_value
+gemcut_fingerprint_main(mrb_state *mrb, void *opaque)
+{
+  const struct gemcut_fingerprint *p = (const struct gemcut_fingerprint *)opaque;
+  const struct gemcut *gcut = get_gemcut(mrb);
+  return mrb_fixnum_value((mrb_int)gemcut_fingerprint_encode(gcut->loaded, p->buf, p->size));
 }
 
 DEFINE_PROTECTED_FUNCTION(
-    MRB_API mrb_bool mruby_gemcut_loaded_p(mrb_state *mrb, const char *name),
-    gemcut_loaded_count_main, (void *)(uintptr_t)name, mrb_bool, FALSE)
+    static size_t gemcut_fingerprint_protect(mrb_state *mrb, struct gemcut_fingerprint *args),
+    gemcut_fingerprint_main, args, mrb_fixnum, 0)
+
+MRB_API size_t
+mruby_gemcut_fingerprint(mrb_state *mrb, char buf[], size_t size)
+{
+  struct gemcut_fingerprint args = { buf, size };
+  return gemcut_fingerprint_protect(mrb, &args);
+}
 
 static mrb_value
-gemcut_s_loaded_feature_p(mrb_state *mrb, mrb_value mod)
+gemcut_s_fingerprint(mrb_state *mrb, mrb_value mod)
 {
   (void)mod;
 
-  const char *name;
-  mrb_get_args(mrb, "z", &name);
   gemcut_check_sealed(mrb);
-  return gemcut_loaded_feature_p_main(mrb, (void *)(uintptr_t)name);
+
+  const struct gemcut *gcut = get_gemcut(mrb);
+  size_t len = gemcut_fingerprint_encode(gcut->loaded, NULL, 0);
+  mrb_value str = mrb_str_new(mrb, NULL, (mrb_int)len);
+  gemcut_fingerprint_encode(gcut->loaded, RSTRING_PTR(str), len + 1);
+
+  return str;
 }
 
+/*
+ * フィンガープリントが表す gem を、依存関係とともにひとつの保護区間の中でまとめて初期化する。
+ */
 static mrb_value
-gemcut_loadable_features_main(mrb_state *mrb, void *opaque)
+gemcut_apply_fingerprint_main(mrb_state *mrb, void *opaque)
 {
-  (void)opaque;
-  (void)get_gemcut(mrb);
+  const char *fp = (const char *)opaque;
+  struct gemcut *gcut = get_gemcut(mrb);
 
-  mrb_value ary = mrb_ary_new(mrb);
-  FOREACH_ALIST(const struct mgem_spec, *mgem, mgems_list) {
-    if (mgem->available) {
-      mrb_ary_push(mrb, ary, mrb_str_new_static(mrb, mgem->name, strlen(mgem->name)));
+  if (gcut->status) {
+    gemcut_sealed_error(mrb);
+  }
+
+  bitmap_unit set[MGEMS_BITMAP_UNITS];
+  switch (gemcut_fingerprint_decode(fp, set)) {
+  case gemcut_fingerprint_ok:
+    break;
+  case gemcut_fingerprint_foreign:
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "fingerprint for another build - %" AUX_PRIs, AUX_PRIs_MAKE(fp));
+  default:
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid fingerprint - %" AUX_PRIs, AUX_PRIs_MAKE(fp));
+  }
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    for (bitmap_unit bits = set[u] & ~gcut->loaded[u]; bits != 0; bits &= bits - 1) {
+      int id = u * MGEMS_UNIT_BITS + ctz64(bits);
+      if (!mgems_list[id].available) {
+        return gemcut_load_error(mrb, mgems_list[id].name);
+      }
+      gemcut_closure_merge(id, gcut->loaded, want);
     }
   }
 
-  return ary;
+  return gemcut_require_commit(mrb, gcut, want);
 }
 
 DEFINE_PROTECTED_FUNCTION(
-    MRB_API mrb_value mruby_gemcut_loadable_features(mrb_state *mrb),
-    gemcut_loadable_features_main, NULL, RESULT_PASSTHROUGH, mrb_nil_value())
+    MRB_API mrb_value mruby_gemcut_apply_fingerprint(mrb_state *mrb, const char *fp),
+    gemcut_apply_fingerprint_main, fp, RESULT_PASSTHROUGH, ret)
 
 static mrb_value
-gemcut_s_loadable_features(mrb_state *mrb, mrb_value mod)
+gemcut_stats_main(mrb_state *mrb, void *opaque)
+{
+  const struct gemcut *gcut = get_gemcut(mrb);
+#ifdef MRUBY_GEMCUT_ENABLE_STATS
+  if (opaque) {
+    *(const struct mruby_gemcut_stat **)opaque = gcut->stats;
+  }
+
+  return mrb_fixnum_value(gcut->numstats);
+#else
+  (void)gcut;
+  if (opaque) {
+    *(const struct mruby_gemcut_stat **)opaque = NULL;
+  }
+
+  return mrb_fixnum_value(0);
+#endif
+}
+
+MRB_API const struct mruby_gemcut_stat *
+mruby_gemcut_stats(mrb_state *mrb, int *num)
+{
+  const struct mruby_gemcut_stat *stats = NULL;
+  mrb_bool error;
+  mrb_value ret = mrb_protect_error(mrb, gemcut_stats_main, (void *)&stats, &error);
+  if (num) {
+    *num = error ? 0 : (int)mrb_fixnum(ret);
+  }
+  return error ? NULL : stats;
+}
+
+/*
+ * MRB_INT32 などで Integer に収まらない値は、切り詰めずに Float として返す。
+ * Float が使えない場合は Integer の最大値 (負の値であれば最小値) に留める。
+ */
+static mrb_value
+gemcut_uint64_value(mrb_state *mrb, uint64_t n)
+{
+  if (n <= (uint64_t)MRB_INT_MAX && FIXABLE((mrb_int)n)) {
+    return mrb_fixnum_value((mrb_int)n);
+  }
+
+#if defined(MRB_NO_FLOAT) || defined(MRB_WITHOUT_FLOAT)
+  (void)mrb;
+  mrb_int max = MRB_INT_MAX;
+  while (!FIXABLE(max)) {
+    max >>= 1;
+  }
+  return mrb_fixnum_value(max);
+#else
+  return mrb_float_value(mrb, (mrb_float)n);
+#endif
+}
+
+static mrb_value
+gemcut_int64_value(mrb_state *mrb, int64_t n)
+{
+  if (n >= 0) {
+    return gemcut_uint64_value(mrb, (uint64_t)n);
+  }
+
+  if (n >= (int64_t)MRB_INT_MIN && FIXABLE((mrb_int)n)) {
+    return mrb_fixnum_value((mrb_int)n);
+  }
+
+#if defined(MRB_NO_FLOAT) || defined(MRB_WITHOUT_FLOAT)
+  (void)mrb;
+  mrb_int min = MRB_INT_MIN;
+  while (!FIXABLE(min)) {
+    min /= 2;
+  }
+  return mrb_fixnum_value(min);
+#else
+  return mrb_float_value(mrb, (mrb_float)n);
+#endif
+}
+
+static mrb_value
+gemcut_s_stats(mrb_state *mrb, mrb_value mod)
 {
   (void)mod;
 
   gemcut_check_sealed(mrb);
-  return gemcut_loadable_features_main(mrb, NULL);
+
+  const struct mruby_gemcut_stat *stats;
+  int num = mrb_fixnum(gemcut_stats_main(mrb, (void *)&stats));
+  if (stats == NULL) {
+    return mrb_nil_value();
+  }
+
+  mrb_value hash = mrb_hash_new(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+  for (; num > 0; num--, stats++) {
+    mrb_value st = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, st, mrb_symbol_value(mrb_intern_lit(mrb, "init_ns")), gemcut_uint64_value(mrb, stats->init_ns));
+    mrb_hash_set(mrb, st, mrb_symbol_value(mrb_intern_lit(mrb, "alloc_calls")), gemcut_uint64_value(mrb, stats->alloc_calls));
+    mrb_hash_set(mrb, st, mrb_symbol_value(mrb_intern_lit(mrb, "alloc_bytes")), gemcut_uint64_value(mrb, stats->alloc_bytes));
+    mrb_hash_set(mrb, st, mrb_symbol_value(mrb_intern_lit(mrb, "objects")), gemcut_int64_value(mrb, stats->objects));
+    mrb_hash_set(mrb, hash, mrb_str_new_static(mrb, stats->name, strlen(stats->name)), st);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return hash;
+}
+
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+static bool
+gemcut_memory_entry(const struct gemcut *gcut, int id, struct mruby_gemcut_memory *e)
+{
+  if (!gemcut_loaded_p_by_id(gcut, id) || !mgems_list[id].gem_init) {
+    return false;
+  }
+
+  e->name = mgems_list[id].name;
+  e->bytes = gemcut_memtrack_bytes(gcut->memtrack, id);
+  e->objects = gcut->objects[id];
+
+  return true;
 }
+#endif
+
+struct gemcut_memory_report
+{
+  struct mruby_gemcut_memory *report;
+  int capa;
+};
 
 static mrb_value
-gemcut_loadable_feature_count_main(mrb_state *mrb, void *opaque)
+gemcut_memory_report_main(mrb_state *mrb, void *opaque)
 {
-  (void)opaque;
-  (void)get_gemcut(mrb);
+  struct gemcut_memory_report *p = (struct gemcut_memory_report *)opaque;
+  const struct gemcut *gcut = get_gemcut(mrb);
+  int num = 0;
 
-  int count = 0;
-  FOREACH_ALIST(const struct mgem_spec, *mgem, mgems_list) {
-    count += mgem->available;
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+  if (gcut->memtrack == NULL) {
+    return mrb_fixnum_value(0);
   }
-  return mrb_fixnum_value(count);
+
+  /* まだ回収されていない一時オブジェクトの分を除く */
+  mrb_full_gc(mrb);
+
+  for (int i = 0; i < MGEMS_POPULATION; i++) {
+    struct mruby_gemcut_memory e;
+    if (gemcut_memory_entry(gcut, i, &e)) {
+      if (num < p->capa) {
+        p->report[num] = e;
+      }
+      num++;
+    }
+  }
+#else
+  (void)gcut;
+  (void)p;
+#endif
+
+  return mrb_fixnum_value(num);
 }
 
 DEFINE_PROTECTED_FUNCTION(
-    MRB_API int mruby_gemcut_loadable_count(mrb_state *mrb),
-    gemcut_loadable_feature_count_main, NULL, mrb_fixnum, -1)
+    static int gemcut_memory_report_protect(mrb_state *mrb, struct gemcut_memory_report *args),
+    gemcut_memory_report_main, args, mrb_fixnum, -1)
+
+MRB_API int
+mruby_gemcut_memory_report(mrb_state *mrb, struct mruby_gemcut_memory report[], int capa)
+{
+  struct gemcut_memory_report args = { report, capa };
+  return gemcut_memory_report_protect(mrb, &args);
+}
 
 static mrb_value
-gemcut_s_loadable_feature_count(mrb_state *mrb, mrb_value mod)
+gemcut_s_memory_report(mrb_state *mrb, mrb_value mod)
 {
   (void)mod;
 
   gemcut_check_sealed(mrb);
-  return gemcut_loadable_feature_count_main(mrb, NULL);
+
+#ifdef MRUBY_GEMCUT_ENABLE_MEMORY_REPORT
+  const struct gemcut *gcut = get_gemcut(mrb);
+  if (gcut->memtrack == NULL) {
+    return mrb_hash_new(mrb);
+  }
+
+  mrb_full_gc(mrb);
+
+  mrb_value hash = mrb_hash_new(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+  for (int i = 0; i < MGEMS_POPULATION; i++) {
+    struct mruby_gemcut_memory e;
+    if (!gemcut_memory_entry(gcut, i, &e)) {
+      continue;
+    }
+
+    mrb_value st = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, st, mrb_symbol_value(mrb_intern_lit(mrb, "bytes")), gemcut_uint64_value(mrb, e.bytes));
+    mrb_hash_set(mrb, st, mrb_symbol_value(mrb_intern_lit(mrb, "objects")), gemcut_int64_value(mrb, e.objects));
+    mrb_hash_set(mrb, hash, mrb_str_new_static(mrb, e.name, strlen(e.name)), st);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return hash;
+#else
+  return mrb_nil_value();
+#endif
 }
 
-static mrb_value
-gemcut_loadable_feature_p_main(mrb_state *mrb, void *opaque)
+/*
+ * want に含まれる gem の費用を足し合わせる。
+ */
+static void
+gemcut_cost_sum(const bitmap_unit want[], struct mruby_gemcut_cost *cost)
 {
-  (void)get_gemcut(mrb);
+  memset(cost, 0, sizeof(*cost));
+  for (int u = 0; u < MGEMS_BITMAP_UNITS; u++) {
+    for (bitmap_unit bits = want[u]; bits != 0; bits &= bits - 1) {
+      const struct mgem_spec *spec = &mgems_list[u * MGEMS_UNIT_BITS + ctz64(bits)];
+      cost->gems++;
+      cost->init_ns += spec->cost_ns;
+      cost->objects += spec->cost_objects;
+      cost->bytes += spec->cost_bytes;
+    }
+  }
+}
 
-  const char *name = (const char *)opaque;
-  int id = gemcut_lookup(mrb, name, TRUE);
-  if (id >= 0 && mgems_list[id].available) {
-    return mrb_true_value();
-  } else {
-    return mrb_false_value();
+struct gemcut_estimated_cost
+{
+  const char *const *names;
+  size_t num;
+  struct mruby_gemcut_cost *cost;
+};
+
+static mrb_value
+gemcut_estimated_cost_main(mrb_state *mrb, void *opaque)
+{
+  const struct gemcut_estimated_cost *p = (const struct gemcut_estimated_cost *)opaque;
+  const struct gemcut *gcut = get_gemcut(mrb);
+
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  for (size_t i = 0; i < p->num; i++) {
+    mrb_value err = gemcut_require_pickup(mrb, gcut, p->names[i], want);
+    if (!mrb_nil_p(err)) {
+      return err;
+    }
   }
+
+  gemcut_cost_sum(want, p->cost);
+
+  return mrb_bool_value(MGEMS_HAVE_COSTS);
 }
 
 DEFINE_PROTECTED_FUNCTION(
-    MRB_API mrb_bool mruby_gemcut_loadable_p(mrb_state *mrb, const char *name),
-    gemcut_loadable_feature_p_main, (void *)(uintptr_t)name, mrb_bool, FALSE)
+    static mrb_value gemcut_estimated_cost_protect(mrb_state *mrb, struct gemcut_estimated_cost *args),
+    gemcut_estimated_cost_main, args, RESULT_PASSTHROUGH, ret)
+
+MRB_API mrb_value
+mruby_gemcut_estimated_cost(mrb_state *mrb, const char *const names[], size_t num, struct mruby_gemcut_cost *cost)
+{
+  struct gemcut_estimated_cost args = { names, num, cost };
+  return gemcut_estimated_cost_protect(mrb, &args);
+}
 
+/*
+ * Gemcut.estimated_cost(gemname_or_gemnames)
+ */
 static mrb_value
-gemcut_s_loadable_feature_p(mrb_state *mrb, mrb_value mod)
+gemcut_s_estimated_cost(mrb_state *mrb, mrb_value mod)
 {
   (void)mod;
 
-  const char *name;
-  mrb_get_args(mrb, "z", &name);
+  mrb_value names;
+  mrb_get_args(mrb, "o", &names);
   gemcut_check_sealed(mrb);
-  return gemcut_loadable_feature_p_main(mrb, (void *)(uintptr_t)name);
+
+  const struct gemcut *gcut = get_gemcut(mrb);
+  bitmap_unit want[MGEMS_BITMAP_UNITS] = { 0 };
+  if (mrb_array_p(names)) {
+    for (mrb_int i = 0; i < RARRAY_LEN(names); i++) {
+      mrb_value v = RARRAY_PTR(names)[i];
+      gemcut_require_pickup(mrb, gcut, mrb_string_value_cstr(mrb, &v), want);
+    }
+  } else {
+    gemcut_require_pickup(mrb, gcut, mrb_string_value_cstr(mrb, &names), want);
+  }
+
+  struct mruby_gemcut_cost cost;
+  gemcut_cost_sum(want, &cost);
+
+  mrb_value hash = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "gems")), mrb_fixnum_value(cost.gems));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "init_ns")), gemcut_uint64_value(mrb, cost.init_ns));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "objects")), gemcut_uint64_value(mrb, cost.objects));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "bytes")), gemcut_uint64_value(mrb, cost.bytes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "measured")), mrb_bool_value(MGEMS_HAVE_COSTS));
+
+  return hash;
 }
 
 static mrb_value
@@ -646,7 +2654,9 @@ gemcut_define_module(mrb_state *mrb, void *unused)
     NO_PRESYM(mrb_intern_lit(mrb, "Gemcut"));
     struct RClass *gemcut_mod = mrb_define_module(mrb, "Gemcut");
 
-    mrb_define_class_method(mrb, gemcut_mod, "require", gemcut_s_require, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, gemcut_mod, "require", gemcut_s_require, MRB_ARGS_REQ(1) | MRB_ARGS_REST());
+    mrb_define_class_method(mrb, gemcut_mod, "require_profile", gemcut_s_require_profile, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, gemcut_mod, "autoload_all", gemcut_s_autoload_all, MRB_ARGS_NONE());
 
     mrb_define_class_method(mrb, gemcut_mod, "loaded_features", gemcut_s_loaded_features, MRB_ARGS_NONE());
     mrb_define_class_method(mrb, gemcut_mod, "loaded_feature_count", gemcut_s_loaded_feature_count, MRB_ARGS_NONE());
@@ -656,6 +2666,15 @@ gemcut_define_module(mrb_state *mrb, void *unused)
     mrb_define_class_method(mrb, gemcut_mod, "loadable_feature_count", gemcut_s_loadable_feature_count, MRB_ARGS_NONE());
     mrb_define_class_method(mrb, gemcut_mod, "loadable_feature?", gemcut_s_loadable_feature_p, MRB_ARGS_REQ(1));
 
+    mrb_define_class_method(mrb, gemcut_mod, "dependencies", gemcut_s_dependencies, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, gemcut_mod, "dependents", gemcut_s_dependents, MRB_ARGS_REQ(1));
+    mrb_define_class_method(mrb, gemcut_mod, "closure", gemcut_s_closure, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+    mrb_define_class_method(mrb, gemcut_mod, "fingerprint", gemcut_s_fingerprint, MRB_ARGS_NONE());
+
+    mrb_define_class_method(mrb, gemcut_mod, "stats", gemcut_s_stats, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, gemcut_mod, "memory_report", gemcut_s_memory_report, MRB_ARGS_NONE());
+    mrb_define_class_method(mrb, gemcut_mod, "estimated_cost", gemcut_s_estimated_cost, MRB_ARGS_REQ(1));
+
     mrb_define_class_method(mrb, gemcut_mod, "lock", gemcut_s_lock, MRB_ARGS_NONE());
     mrb_define_class_method(mrb, gemcut_mod, "lock!", gemcut_s_lock, MRB_ARGS_NONE());
 
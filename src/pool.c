@@ -0,0 +1,278 @@
+#include "sysdep.h"
+#include "internals.h"
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * 指定した gem の組み合わせを初期化済みの mrb_state を待機させておく仕組み。
+ *
+ * 待機数が min を下回ると補充スレッドが max まで補充する。
+ * MRUBY_GEMCUT_NO_THREAD の場合は、mruby_gemcut_pool_checkin() の呼び出し元で補充する。
+ */
+
+struct mruby_gemcut_pool
+{
+  mrb_allocf allocf;
+  void *ud;
+  const char *profile;
+  int min, max;
+
+  aux_mutex_t lock;
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  aux_cond_t wakeup;
+  aux_thread_t refiller;
+  bool running;
+#endif
+  bool shutdown;
+
+  struct mruby_gemcut_pool_stats stats;
+
+  int idle;
+  mrb_state **vms; /* 待機している mrb_state の積み重ね (max 個) */
+};
+
+static mrb_state *
+pool_build(struct mruby_gemcut_pool *pool)
+{
+  mrb_state *mrb = mrb_open_core(pool->allocf, pool->ud);
+  if (mrb == NULL) {
+    return NULL;
+  }
+
+  if (pool->profile) {
+    mrb_value ret = mruby_gemcut_require_profile(mrb, pool->profile);
+    if (mrb_exception_p(ret)) {
+      mrb_close(mrb);
+      return NULL;
+    }
+  }
+
+  /*
+   * 返却された時にこの状態へ巻き戻す。
+   * 失敗した場合 (巻き戻しに対応していない mruby など) は、返却された時に破棄される。
+   */
+  mruby_gemcut_checkpoint(mrb);
+  mrb->exc = NULL;
+
+  return mrb;
+}
+
+/*
+ * 返却された mrb_state を構築直後の状態に巻き戻して待機させる。
+ * 待機数が max に達している場合や、巻き戻しに失敗した場合は false を返す。
+ */
+static bool
+pool_recycle(struct mruby_gemcut_pool *pool, mrb_state *mrb)
+{
+  aux_mutex_lock(&pool->lock);
+  bool room = pool->idle < pool->max && !pool->shutdown;
+  aux_mutex_unlock(&pool->lock);
+  if (!room) {
+    return false;
+  }
+
+  mrb->exc = NULL;
+  if (mrb_exception_p(mruby_gemcut_rollback(mrb))) {
+    return false;
+  }
+
+  aux_mutex_lock(&pool->lock);
+  room = pool->idle < pool->max && !pool->shutdown;
+  if (room) {
+    pool->vms[pool->idle++] = mrb;
+    pool->stats.recycles++;
+  }
+  aux_mutex_unlock(&pool->lock);
+
+  return room;
+}
+
+/*
+ * 待機数が max に達するまで mrb_state を構築する。
+ * 呼び出し時点で pool->lock を獲得していなければならない。
+ */
+static void
+pool_refill(struct mruby_gemcut_pool *pool)
+{
+  while (pool->idle < pool->max && !pool->shutdown) {
+    aux_mutex_unlock(&pool->lock);
+    uint64_t start = aux_monotonic_ns();
+    mrb_state *mrb = pool_build(pool);
+    uint64_t elapsed = aux_monotonic_ns() - start;
+    aux_mutex_lock(&pool->lock);
+
+    if (mrb == NULL) {
+      pool->stats.failures++;
+      break;
+    }
+
+    pool->stats.refills++;
+    pool->stats.refill_ns_total += elapsed;
+    if (pool->stats.refill_ns_max < elapsed) {
+      pool->stats.refill_ns_max = elapsed;
+    }
+
+    if (pool->idle < pool->max && !pool->shutdown) {
+      pool->vms[pool->idle++] = mrb;
+    } else {
+      aux_mutex_unlock(&pool->lock);
+      mrb_close(mrb);
+      aux_mutex_lock(&pool->lock);
+    }
+  }
+}
+
+#ifndef MRUBY_GEMCUT_NO_THREAD
+static void *
+pool_refiller(void *opaque)
+{
+  struct mruby_gemcut_pool *pool = (struct mruby_gemcut_pool *)opaque;
+
+  aux_mutex_lock(&pool->lock);
+  while (!pool->shutdown) {
+    if (pool->idle < pool->min) {
+      pool_refill(pool);
+    }
+
+    /*
+     * pool_refill() はロックを手放して構築するため、その間に送られた shutdown の通知は取りこぼしている。
+     * 待つ前に確かめ直さないと、mruby_gemcut_pool_free() の aux_thread_join() が戻らなくなる。
+     */
+    if (pool->shutdown) {
+      break;
+    }
+    aux_cond_wait(&pool->wakeup, &pool->lock);
+  }
+  aux_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+#endif
+
+MRB_API struct mruby_gemcut_pool *
+mruby_gemcut_pool_new(mrb_allocf allocf, void *ud, const char *profile, int min, int max)
+{
+  if (allocf == NULL) {
+    allocf = mrb_default_allocf;
+  }
+
+  if (max < 1 || min < 0 || min > max) {
+    return NULL;
+  }
+
+  size_t namesize = profile ? strlen(profile) + 1 : 0;
+  size_t size = sizeof(struct mruby_gemcut_pool) + sizeof(mrb_state *) * max;
+  /* allocf は mrb_state を必要とする場合があるため、プール自体は malloc() で確保する */
+  struct mruby_gemcut_pool *pool = (struct mruby_gemcut_pool *)malloc(size + namesize);
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  memset(pool, 0, size);
+  pool->allocf = allocf;
+  pool->ud = ud;
+  pool->vms = (mrb_state **)(pool + 1);
+  if (profile) {
+    pool->profile = (char *)pool + size;
+    memcpy((char *)pool + size, profile, namesize);
+  }
+  pool->min = min;
+  pool->max = max;
+  aux_mutex_init(&pool->lock);
+
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  aux_cond_init(&pool->wakeup);
+  aux_mutex_lock(&pool->lock);
+  pool->running = aux_thread_create(&pool->refiller, pool_refiller, pool);
+  aux_mutex_unlock(&pool->lock);
+#else
+  if (pool->min > 0) {
+    pool_refill(pool);
+  }
+#endif
+
+  return pool;
+}
+
+MRB_API mrb_state *
+mruby_gemcut_pool_checkout(struct mruby_gemcut_pool *pool)
+{
+  mrb_state *mrb = NULL;
+
+  aux_mutex_lock(&pool->lock);
+  if (pool->idle > 0) {
+    mrb = pool->vms[--pool->idle];
+    pool->stats.hits++;
+  } else {
+    pool->stats.misses++;
+  }
+
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  if (pool->idle < pool->min && pool->running) {
+    aux_cond_signal(&pool->wakeup);
+  }
+#endif
+  aux_mutex_unlock(&pool->lock);
+
+  if (mrb == NULL) {
+    mrb = pool_build(pool);
+  }
+
+  return mrb;
+}
+
+MRB_API void
+mruby_gemcut_pool_checkin(struct mruby_gemcut_pool *pool, mrb_state *mrb)
+{
+  if (mrb && !pool_recycle(pool, mrb)) {
+    mrb_close(mrb);
+  }
+
+#ifdef MRUBY_GEMCUT_NO_THREAD
+  aux_mutex_lock(&pool->lock);
+  if (pool->idle < pool->min) {
+    pool_refill(pool);
+  }
+  aux_mutex_unlock(&pool->lock);
+#endif
+}
+
+MRB_API void
+mruby_gemcut_pool_stats(struct mruby_gemcut_pool *pool, struct mruby_gemcut_pool_stats *stats)
+{
+  aux_mutex_lock(&pool->lock);
+  *stats = pool->stats;
+  stats->idle = pool->idle;
+  aux_mutex_unlock(&pool->lock);
+}
+
+MRB_API void
+mruby_gemcut_pool_free(struct mruby_gemcut_pool *pool)
+{
+  if (pool == NULL) {
+    return;
+  }
+
+  aux_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  if (pool->running) {
+    aux_cond_signal(&pool->wakeup);
+  }
+#endif
+  aux_mutex_unlock(&pool->lock);
+
+#ifndef MRUBY_GEMCUT_NO_THREAD
+  if (pool->running) {
+    aux_thread_join(pool->refiller);
+  }
+  aux_cond_destroy(&pool->wakeup);
+#endif
+  aux_mutex_destroy(&pool->lock);
+
+  for (int i = 0; i < pool->idle; i++) {
+    mrb_close(pool->vms[i]);
+  }
+
+  free(pool);
+}
@@ -0,0 +1,90 @@
+#ifndef MRUBY_GEMCUT_SYSDEP_H
+#define MRUBY_GEMCUT_SYSDEP_H 1
+
+/*
+ * NOTE: このファイルは他のヘッダファイルよりも先に読み込む必要がある
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+#if !defined(MRUBY_GEMCUT_NO_THREAD) && !(defined(__unix__) || defined(__APPLE__))
+# define MRUBY_GEMCUT_NO_THREAD 1
+#endif
+
+#if !defined(MRUBY_GEMCUT_NO_FORK) && !(defined(__unix__) || defined(__APPLE__))
+# define MRUBY_GEMCUT_NO_FORK 1
+#endif
+
+#ifndef MRUBY_GEMCUT_NO_THREAD
+# include <pthread.h>
+
+typedef pthread_t aux_thread_t;
+typedef pthread_mutex_t aux_mutex_t;
+typedef pthread_cond_t aux_cond_t;
+
+# define aux_thread_create(T, FUNC, ARG) (pthread_create((T), NULL, (FUNC), (ARG)) == 0)
+# define aux_thread_join(T) pthread_join((T), NULL)
+# define aux_mutex_init(M) pthread_mutex_init((M), NULL)
+# define aux_mutex_destroy(M) pthread_mutex_destroy(M)
+# define aux_mutex_lock(M) pthread_mutex_lock(M)
+# define aux_mutex_unlock(M) pthread_mutex_unlock(M)
+# define aux_cond_init(C) pthread_cond_init((C), NULL)
+# define aux_cond_destroy(C) pthread_cond_destroy(C)
+# define aux_cond_wait(C, M) pthread_cond_wait((C), (M))
+# define aux_cond_signal(C) pthread_cond_signal(C)
+#else
+typedef int aux_mutex_t;
+
+# define aux_mutex_init(M) ((void)(M))
+# define aux_mutex_destroy(M) ((void)(M))
+# define aux_mutex_lock(M) ((void)(M))
+# define aux_mutex_unlock(M) ((void)(M))
+#endif
+
+#if defined(__cplusplus) && __cplusplus >= 201103L
+# define AUX_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+# define AUX_THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+# define AUX_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+# define AUX_THREAD_LOCAL __thread
+#endif
+
+#if defined(__GNUC__)
+# define aux_atomic_load(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+# define aux_atomic_increment(P) ((void)__atomic_add_fetch((P), 1, __ATOMIC_ACQ_REL))
+#elif defined(_MSC_VER)
+# include <intrin.h>
+# define aux_atomic_load(P) ((uint32_t)_InterlockedOr((volatile long *)(P), 0))
+# define aux_atomic_increment(P) ((void)_InterlockedIncrement((volatile long *)(P)))
+#else
+# define aux_atomic_load(P) (*(volatile uint32_t *)(P))
+# define aux_atomic_increment(P) ((void)++*(volatile uint32_t *)(P))
+#endif
+
+/*
+ * 単調増加する時刻をナノ秒で返す
+ */
+static inline uint64_t
+aux_monotonic_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#elif defined(TIME_UTC)
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#endif
+}
+
+#endif /* MRUBY_GEMCUT_SYSDEP_H */
@@ -12,9 +12,11 @@ config = YAML.load <<'YAML'
     nobox:
       defines: [MRB_INT32, MRB_NO_BOXING]
       gem: "mruby-string-ext"
+      gemcut-stats: true
     wordbox++:
       defines: [MRB_INT64, MRB_WORD_BOXING]
       c++abi: true
+      gemcut-memory-report: true
 YAML
 
 MRuby::Lockfile.disable rescue nil
@@ -27,6 +29,8 @@ MRuby::Build.new do
   enable_debug
 
   gem __dir__ do |g|
+    g.add_profile "printer", %w(print sprintf)
+
     if g.cc.command =~ /\b(?:g?cc|clang)\d*\b/
       g.cc.flags << "-std=c11"
       g.cc.flags << %w(-Wpedantic -Wall -Wextra)
@@ -40,6 +44,30 @@ MRuby::Build.new do
   gem File.join(__dir__, "testgem")
 end
 
+# GEMCUT_SYNTH_GEMS=<数> を与えると、その数の架空の gem を含む "synth" ビルドを追加する
+if (synthgems = ENV["GEMCUT_SYNTH_GEMS"].to_i) > 0
+  require_relative "buildlib/synthgems"
+
+  MRuby::Build.new("synth") do |conf|
+    toolchain :clang
+
+    conf.build_dir = File.expand_path("#{buildbase}/#{name}")
+
+    enable_debug
+    enable_bintest if Dir.pwd == MRUBY_ROOT
+
+    gem __dir__ do |g|
+      g.add_profile "printer", %w(print sprintf)
+    end
+
+    gembox "default"
+
+    Gemcut::Synth.generate(File.join(conf.build_dir, "synthgems"), synthgems).each { |dir| gem dir }
+
+    gem File.join(__dir__, "testgem")
+  end
+end
+
 config["builds"].each_pair do |n, c|
   MRuby::Build.new(n) do |conf|
     toolchain :clang
@@ -62,6 +90,10 @@ config["builds"].each_pair do |n, c|
     Array(c["gems"]).each { |*g| gem *g }
 
     gem __dir__ do |g|
+      g.add_profile "printer", %w(print sprintf)
+      g.enable_stats if c["gemcut-stats"]
+      g.enable_memory_report if c["gemcut-memory-report"]
+
       if g.cc.command =~ /\b(?:g?cc|clang)\d*\b/
         g.cc.flags << (c["c++abi"] ? "-std=c++11" : "-std=c11")
         g.cc.flags << %w(-Wpedantic -Wall -Wextra)
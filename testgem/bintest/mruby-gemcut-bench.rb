@@ -0,0 +1,32 @@
+require "json"
+
+# 計測結果はビルドディレクトリの mruby-gemcut-bench.jsonl に保存する。
+#
+# MRUBY_GEMCUT_BENCH_BASELINE にディレクトリを与えると、その中の "<ビルド名>.jsonl" と p50 を比べ、
+# MRUBY_GEMCUT_BENCH_THRESHOLD 倍 (省略時は 1.5 倍) を超えて遅くなった操作があれば失敗する。
+
+assert "mruby-gemcut-bench" do
+  builddir = ENV["BUILD_DIR"] || "."
+  output = `#{cmd('mruby-gemcut-bench')}`
+  assert_true $?.success?
+
+  results = output.each_line.map { |l| JSON.parse(l) }
+  ops = results.map { |r| r["op"] }
+  assert_equal %w(open_require imitate_to lookup_hit lookup_miss loaded_features close), ops
+  results.each { |r| assert_true r["p50_ns"] <= r["p99_ns"], r["op"] }
+
+  File.write File.join(builddir, "mruby-gemcut-bench.jsonl"), output
+
+  if basedir = ENV["MRUBY_GEMCUT_BENCH_BASELINE"]
+    basefile = File.join(basedir, "#{File.basename(File.expand_path(builddir))}.jsonl")
+    if File.exist?(basefile)
+      threshold = Float(ENV["MRUBY_GEMCUT_BENCH_THRESHOLD"] || 1.5)
+      baseline = File.foreach(basefile).map { |l| r = JSON.parse(l); [r["op"], r] }.to_h
+      results.each do |r|
+        base = baseline[r["op"]] or next
+        limit = base["p50_ns"] * threshold
+        assert_true r["p50_ns"] <= limit, "#{r["op"]}: p50 #{r["p50_ns"]} ns exceeds #{limit.round} ns (baseline #{base["p50_ns"]} ns x #{threshold})"
+      end
+    end
+  end
+end
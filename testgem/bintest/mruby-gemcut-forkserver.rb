@@ -0,0 +1,24 @@
+require "json"
+
+# フォークサーバのワーカーがテンプレートとページを共有していることを確かめる。
+# 結果はビルドディレクトリの mruby-gemcut-forkserver.jsonl に保存する。
+# fork(2) や /proc/<pid>/smaps が使えない環境では何も確かめない。
+
+assert "mruby-gemcut-forkserver" do
+  builddir = ENV["BUILD_DIR"] || "."
+  output = `#{cmd('mruby-gemcut-forkserver')}`
+  assert_true $?.success?, output
+  next if output.empty?
+
+  File.write File.join(builddir, "mruby-gemcut-forkserver.jsonl"), output
+
+  results = output.each_line.map { |l| JSON.parse(l) }
+  assert_equal "template", results[0]["role"]
+  workers = results.drop(1)
+  assert_false workers.empty?
+  workers.each do |r|
+    assert_equal "worker", r["role"]
+    assert_true r["shared_kb"] > 0, "worker #{r["index"]}: no pages are shared"
+    assert_true r["private_kb"] < r["rss_kb"], "worker #{r["index"]}: #{r["private_kb"]} KiB of #{r["rss_kb"]} KiB are private"
+  end
+end
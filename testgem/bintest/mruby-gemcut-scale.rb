@@ -0,0 +1,25 @@
+require "json"
+
+# buildlib/synthgems.rb で生成した gem を含むビルド (test_config.rb の GEMCUT_SYNTH_GEMS を参照) でのみ意味を持つ。
+# 各操作に掛かる時間が初期化した gem の数に対して線形を超えて増えないこと
+# (隣り合う計測点の時間の比が、gem の数の比の MRUBY_GEMCUT_SCALE_SLACK 倍 (省略時は 2 倍) を超えないこと) を確かめる。
+# 結果はビルドディレクトリの mruby-gemcut-scale.jsonl に保存する。
+
+assert "mruby-gemcut-scale" do
+  builddir = ENV["BUILD_DIR"] || "."
+  output = `#{cmd('mruby-gemcut-scale')}`
+  assert_true $?.success?
+  next if output.empty?
+
+  File.write File.join(builddir, "mruby-gemcut-scale.jsonl"), output
+
+  slack = Float(ENV["MRUBY_GEMCUT_SCALE_SLACK"] || 2)
+  results = output.each_line.map { |l| JSON.parse(l) }
+  results.group_by { |r| r["op"] }.each_pair do |op, points|
+    points.sort_by { |r| r["loaded"] }.each_cons(2) do |a, b|
+      next if b["loaded"] <= a["loaded"]
+      limit = a["ns"] * slack * b["loaded"] / a["loaded"]
+      assert_true b["ns"] <= limit, "#{op}: #{b["ns"]} ns for #{b["loaded"]} gems exceeds #{limit.round} ns (#{a["ns"]} ns for #{a["loaded"]} gems, total #{a["total"]})"
+    end
+  end
+end
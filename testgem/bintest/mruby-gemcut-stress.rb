@@ -0,0 +1,28 @@
+require "json"
+
+# スレッド数を増やしても mrb_state の構築・破棄が失敗したりメモリを取りこぼしたりしないことを確かめる。
+# 結果はビルドディレクトリの mruby-gemcut-stress.jsonl に保存する。
+#
+# 処理量はマシンの CPU 数や負荷に左右されるため、環境変数 MRUBY_GEMCUT_STRESS_MIN_SCALING が与えられた場合にのみ、
+# 1 スレッドのその倍数を下回らないことも確かめる。
+
+assert "mruby-gemcut-stress" do
+  builddir = ENV["BUILD_DIR"] || "."
+  output = `#{cmd('mruby-gemcut-stress')}`
+  File.write File.join(builddir, "mruby-gemcut-stress.jsonl"), output
+  assert_true $?.success?, output
+
+  results = output.each_line.map { |l| JSON.parse(l) }
+  assert_false results.empty?
+  assert_equal 1, results[0]["threads"]
+
+  min = ENV["MRUBY_GEMCUT_STRESS_MIN_SCALING"]
+  min = (min.nil? || min.empty?) ? nil : Float(min)
+  results.each do |r|
+    assert_equal 0, r["failures"], "#{r["threads"]} threads"
+    assert_equal 0, r["leaks"], "#{r["threads"]} threads"
+    if min
+      assert_true r["scaling"] >= min, "#{r["threads"]} threads: #{r["vms_per_sec"]} VMs/s is #{r["scaling"]}x of 1 thread (minimum #{min}x)"
+    end
+  end
+end
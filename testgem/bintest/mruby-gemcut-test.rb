@@ -44,5 +44,63 @@ raised exceptions - uninitialized constant Gemcut (NameError)
 ["mruby-gemcut", "mruby-print"]
 >> loaded gems: ["mruby-gemcut"]
 ["mruby-array-ext", "mruby-gemcut", "mruby-hash-ext", "mruby-print"]
+>> loaded gems: ["mruby-gemcut", "mruby-math", "mruby-print"]
+["mruby-gemcut", "mruby-math", "mruby-print"]
+>> loaded gems: ["mruby-gemcut"]
+["mruby-gemcut", "mruby-print", "mruby-sprintf"]
+>> loaded gems: ["mruby-gemcut", "mruby-print"]
+LoadError
+false
+>> loaded gems: ["mruby-gemcut"]
+["mruby-gemcut", "mruby-print", "mruby-sprintf"]
+>> loaded gems: ["mruby-gemcut", "mruby-print"]
+LoadError
+>> loaded gems: ["mruby-gemcut", "mruby-print", "mruby-sprintf"]
+["mruby-gemcut", "mruby-print", "mruby-sprintf"]
+>> pool checkouts: 1
+>> imitate failures: 0
+>> loaded gems: ["mruby-gemcut", "mruby-math", "mruby-print"]
+["mruby-gemcut", "mruby-math", "mruby-print"]
+>> loaded gems: ["mruby-gemcut", "mruby-math", "mruby-print"]
+["mruby-gemcut", "mruby-math", "mruby-print"]
+>> loaded gems: ["mruby-gemcut"]
+-1
+["mruby-gemcut", "mruby-math", "mruby-print"]
+>> loaded gems: ["mruby-gemcut"]
+:NameError
+["mruby-gemcut", "mruby-print"]
+>> loaded gems: ["mruby-gemcut", "mruby-print", "mruby-sprintf"]
+["mruby-gemcut", "mruby-print", "mruby-sprintf"]
+>> stats after rollback: restored
+>> loaded gems: ["mruby-gemcut", "mruby-print"]
+false
+["mruby-gemcut", "mruby-print"]
+>> loaded gems: ["mruby-array-ext", "mruby-gemcut", "mruby-print"]
+["mruby-array-ext"]
+true
+["mruby-hash-ext"]
+["mruby-array-ext", "mruby-hash-ext"]
+>> loaded gems: ["mruby-gemcut", "mruby-print"]
+3
+0
+>> budget: mruby-math - exceeded the memory budget (LoadError)
+>> budget allocf restored: true
+>> loaded gems: ["mruby-gemcut", "mruby-print"]
+false
+2.0
+>> apply fingerprint: true
+>> apply foreign fingerprint: fingerprint for another build - 00000000-1 (ArgumentError)
+>> apply oversized fingerprint: ArgumentError
+>> loaded gems: ["mruby-gemcut", "mruby-math", "mruby-print"]
+true
+>> loaded gems: ["mruby-gemcut", "mruby-print"]
+>> hook: before init mruby-math
+>> hook: after init mruby-math
+2.0
+>> hook: before final mruby-math
+>> hook: after final mruby-math
+>> final: mruby-sprintf
+>> final: mruby-math
+>> final: mruby-hash-ext
   OUTPUT
 end
@@ -0,0 +1,171 @@
+#include <mruby-gemcut.h>
+#include <mruby.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * gemcut の各操作に掛かる時間の分布を計測し、JSON Lines 形式で標準出力に書き出す。
+ *
+ *      {"op":"open_require","unit":1,"samples":200,"p50_ns":12345,"p99_ns":23456}
+ *
+ * 反復回数は環境変数 MRUBY_GEMCUT_BENCH_ITERATIONS で変更できる。
+ * 1 回の操作が時計の分解能より短いものは unit 回まとめて計測し、1 回あたりの時間に換算する。
+ */
+
+static const char *const bench_gems[] = {
+  "mruby-print", "mruby-sprintf", "mruby-math", "mruby-hash-ext",
+};
+
+#define BENCH_NUMGEMS ((int)(sizeof(bench_gems) / sizeof(bench_gems[0])))
+#define BENCH_UNIT 1000
+
+static uint64_t
+bench_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void
+bench_report(const char *op, int unit, uint64_t samples[], int num)
+{
+  qsort(samples, num, sizeof(samples[0]), bench_compare);
+  uint64_t p50 = samples[(num - 1) * 50 / 100] / unit;
+  uint64_t p99 = samples[(num - 1) * 99 / 100] / unit;
+  printf("{\"op\":\"%s\",\"unit\":%d,\"samples\":%d,\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+         op, unit, num, (unsigned long long)p50, (unsigned long long)p99);
+  fflush(stdout);
+}
+
+static mrb_state *
+bench_open(void)
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+  if (mrb == NULL) {
+    fputs("mrb_open_core failed\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  return mrb;
+}
+
+static void
+bench_open_require(uint64_t samples[], int num)
+{
+  for (int i = 0; i < num; i++) {
+    uint64_t t = bench_now();
+    mrb_state *mrb = bench_open();
+    mruby_gemcut_require_many(mrb, bench_gems, BENCH_NUMGEMS);
+    samples[i] = bench_now() - t;
+    mrb_close(mrb);
+  }
+
+  bench_report("open_require", 1, samples, num);
+}
+
+static void
+bench_close(uint64_t samples[], int num)
+{
+  for (int i = 0; i < num; i++) {
+    mrb_state *mrb = bench_open();
+    mruby_gemcut_require_many(mrb, bench_gems, BENCH_NUMGEMS);
+    uint64_t t = bench_now();
+    mrb_close(mrb);
+    samples[i] = bench_now() - t;
+  }
+
+  bench_report("close", 1, samples, num);
+}
+
+static void
+bench_imitate_to(uint64_t samples[], int num)
+{
+  mrb_state *src = bench_open();
+  mruby_gemcut_require_many(src, bench_gems, BENCH_NUMGEMS);
+
+  for (int i = 0; i < num; i++) {
+    mrb_state *dest = bench_open();
+    uint64_t t = bench_now();
+    mruby_gemcut_imitate_to(dest, src);
+    samples[i] = bench_now() - t;
+    mrb_close(dest);
+  }
+
+  mrb_close(src);
+  bench_report("imitate_to", 1, samples, num);
+}
+
+static void
+bench_lookup(uint64_t samples[], int num, const char *op, const char *name)
+{
+  mrb_state *mrb = bench_open();
+  mruby_gemcut_require_many(mrb, bench_gems, BENCH_NUMGEMS);
+
+  for (int i = 0; i < num; i++) {
+    uint64_t t = bench_now();
+    for (int j = 0; j < BENCH_UNIT; j++) {
+      mruby_gemcut_loadable_p(mrb, name);
+    }
+    samples[i] = bench_now() - t;
+  }
+
+  mrb_close(mrb);
+  bench_report(op, BENCH_UNIT, samples, num);
+}
+
+static void
+bench_loaded_features(uint64_t samples[], int num)
+{
+  mrb_state *mrb = bench_open();
+  mruby_gemcut_require_many(mrb, bench_gems, BENCH_NUMGEMS);
+
+  for (int i = 0; i < num; i++) {
+    int ai = mrb_gc_arena_save(mrb);
+    uint64_t t = bench_now();
+    mruby_gemcut_loaded_features(mrb);
+    samples[i] = bench_now() - t;
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  mrb_close(mrb);
+  bench_report("loaded_features", 1, samples, num);
+}
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  const char *env = getenv("MRUBY_GEMCUT_BENCH_ITERATIONS");
+  int num = env ? atoi(env) : 200;
+  if (num < 1) {
+    num = 1;
+  }
+
+  uint64_t *samples = (uint64_t *)malloc(sizeof(uint64_t) * num);
+  if (samples == NULL) {
+    fputs("out of memory\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  bench_open_require(samples, num);
+  bench_imitate_to(samples, num);
+  bench_lookup(samples, num, "lookup_hit", "mruby-print");
+  bench_lookup(samples, num, "lookup_miss", "no-such-gem");
+  bench_loaded_features(samples, num);
+  bench_close(samples, num);
+
+  free(samples);
+
+  return EXIT_SUCCESS;
+}
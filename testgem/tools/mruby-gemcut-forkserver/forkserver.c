@@ -0,0 +1,267 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <mruby-gemcut.h>
+#include <mruby.h>
+#include <mruby/compile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+# include <errno.h>
+# include <sys/socket.h>
+# include <sys/types.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+/*
+ * mruby_gemcut_forkserver_run() を子プロセスで動かし、ワーカーを何個か作らせてから、
+ * テンプレートと各ワーカーのメモリの使用量を JSON Lines 形式で標準出力に書き出す。
+ *
+ *      {"role":"template","pid":1234,"rss_kb":2048,"pss_kb":1024,"shared_kb":1536,"private_kb":512}
+ *      {"role":"worker","index":0,"pid":1235,"fork_ns":345678,"rss_kb":2048,"pss_kb":640,"shared_kb":1800,"private_kb":248}
+ *
+ * 各ワーカーは Ruby のコードを少し実行してから計測される。
+ * fork_ns は fork の要求を送ってからワーカーが実行を終えるまでの時間。
+ * ワーカーの数は環境変数 MRUBY_GEMCUT_FORKSERVER_WORKERS で変更できる。
+ * fork(2) や /proc/<pid>/smaps が使えない環境では何も出力しない。
+ */
+
+#define FORKSERVER_PROFILE "printer"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+static uint64_t
+forkserver_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int
+forkserver_readline(int fd, char buf[], size_t size)
+{
+  size_t len = 0;
+  for (;;) {
+    char ch;
+    ssize_t n = read(fd, &ch, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 || len + 1 >= size) {
+      return -1;
+    }
+    if (ch == '\n') {
+      buf[len] = '\0';
+      return 0;
+    }
+    buf[len++] = ch;
+  }
+}
+
+/*
+ * 要求元が接続を閉じるまで待機する
+ */
+static void
+forkserver_worker(mrb_state *mrb, int fd, void *opaque)
+{
+  (void)opaque;
+
+  mrb_value ret = mrb_load_string(mrb, "format('%d', [1, 2, 3].map { |e| e * 2 }.size)");
+  const char *reply = (mrb->exc == NULL && !mrb_nil_p(ret)) ? "ready\n" : "error\n";
+  if (write(fd, reply, strlen(reply)) < 0) {
+    return;
+  }
+
+  char buf[16];
+  forkserver_readline(fd, buf, sizeof(buf));
+}
+
+static int
+forkserver_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  /* サーバがテンプレートを構築し終えるまで待つ */
+  for (int retry = 0; retry < 500; retry++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    close(fd);
+
+    struct timespec wait = { 0, 10 * 1000 * 1000 };
+    nanosleep(&wait, NULL);
+  }
+
+  return -1;
+}
+
+static int
+forkserver_request(const char *path, const char *req)
+{
+  int fd = forkserver_connect(path);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (write(fd, req, strlen(req)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int
+forkserver_env(const char *name, int defval)
+{
+  const char *env = getenv(name);
+  int n = env ? atoi(env) : defval;
+  return (n < 1) ? 1 : n;
+}
+
+static void
+forkserver_print(const char *role, int index, long pid, uint64_t ns, const struct mruby_gemcut_smaps *smaps)
+{
+  printf("{\"role\":\"%s\",", role);
+  if (index >= 0) {
+    printf("\"index\":%d,", index);
+  }
+  printf("\"pid\":%ld,", pid);
+  if (index >= 0) {
+    printf("\"fork_ns\":%llu,", (unsigned long long)ns);
+  }
+  printf("\"rss_kb\":%llu,\"pss_kb\":%llu,\"shared_kb\":%llu,\"private_kb\":%llu}\n",
+         (unsigned long long)(smaps->rss / 1024),
+         (unsigned long long)(smaps->pss / 1024),
+         (unsigned long long)((smaps->shared_clean + smaps->shared_dirty) / 1024),
+         (unsigned long long)((smaps->private_clean + smaps->private_dirty) / 1024));
+}
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  struct mruby_gemcut_smaps smaps;
+  if (mruby_gemcut_smaps((long)getpid(), &smaps) != 0) {
+    return EXIT_SUCCESS;
+  }
+
+  int num = forkserver_env("MRUBY_GEMCUT_FORKSERVER_WORKERS", 4);
+  int *fds = (int *)malloc(sizeof(int) * num);
+  long *pids = (long *)malloc(sizeof(long) * num);
+  uint64_t *times = (uint64_t *)malloc(sizeof(uint64_t) * num);
+  if (fds == NULL || pids == NULL || times == NULL) {
+    fputs("out of memory\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  const char *tmpdir = getenv("TMPDIR");
+  char path[108];
+  snprintf(path, sizeof(path), "%s/mruby-gemcut-forkserver.%ld.sock", tmpdir ? tmpdir : "/tmp", (long)getpid());
+
+  fflush(NULL);
+  pid_t server = fork();
+  if (server < 0) {
+    perror("fork");
+    return EXIT_FAILURE;
+  }
+
+  if (server == 0) {
+    struct mruby_gemcut_forkserver fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.profile = FORKSERVER_PROFILE;
+    fs.path = path;
+    fs.generational = TRUE;
+    fs.worker = forkserver_worker;
+    int forked = mruby_gemcut_forkserver_run(&fs);
+    fflush(NULL);
+    _exit((forked == num) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  int status = EXIT_SUCCESS;
+  int started = 0;
+  for (; started < num; started++) {
+    char line[32];
+    uint64_t t = forkserver_now();
+    int fd = forkserver_request(path, "fork\n");
+    if (fd < 0 ||
+        forkserver_readline(fd, line, sizeof(line)) != 0 ||
+        (pids[started] = atol(line)) <= 0 ||
+        forkserver_readline(fd, line, sizeof(line)) != 0 ||
+        strcmp(line, "ready") != 0) {
+      fprintf(stderr, "worker %d: failed to start\n", started);
+      if (fd >= 0) {
+        close(fd);
+      }
+      status = EXIT_FAILURE;
+      break;
+    }
+    times[started] = forkserver_now() - t;
+    fds[started] = fd;
+  }
+
+  /* 全てのワーカーが生きている間に計測する */
+  if (mruby_gemcut_smaps((long)server, &smaps) == 0) {
+    forkserver_print("template", -1, (long)server, 0, &smaps);
+  }
+  for (int i = 0; i < started; i++) {
+    if (mruby_gemcut_smaps(pids[i], &smaps) == 0) {
+      forkserver_print("worker", i, pids[i], times[i], &smaps);
+    } else {
+      fprintf(stderr, "worker %d: failed to read smaps\n", i);
+      status = EXIT_FAILURE;
+    }
+  }
+  fflush(stdout);
+
+  for (int i = 0; i < started; i++) {
+    close(fds[i]);
+  }
+
+  int fd = forkserver_request(path, "quit\n");
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  int st;
+  if (waitpid(server, &st, 0) != server || !WIFEXITED(st) || WEXITSTATUS(st) != EXIT_SUCCESS) {
+    if (status == EXIT_SUCCESS) {
+      fputs("server failed\n", stderr);
+    }
+    status = EXIT_FAILURE;
+  }
+
+  free(fds);
+  free(pids);
+  free(times);
+
+  return status;
+}
+
+#else
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  return EXIT_SUCCESS;
+}
+
+#endif
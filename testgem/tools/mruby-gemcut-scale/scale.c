@@ -0,0 +1,168 @@
+#include <mruby-gemcut.h>
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * 読み込む gem の数を変えながら gemcut の各操作に掛かる時間を計測し、JSON Lines 形式で標準出力に書き出す。
+ *
+ *      {"total":5003,"loaded":17,"op":"require","ns":12345}
+ *
+ * total は利用可能な gem の総数、loaded は依存関係を含めて初期化された gem の数で、ns は中央値。
+ * 計測には buildlib/synthgems.rb で生成した "synth-" で始まる gem を使い、それが無ければ何も出力しない。
+ * 反復回数は環境変数 MRUBY_GEMCUT_SCALE_REPEAT で変更できる。
+ */
+
+enum {
+  SCALE_REQUIRE,
+  SCALE_IMITATE,
+  SCALE_LOADED_FEATURES,
+  SCALE_CLOSE,
+  SCALE_NUMOPS
+};
+
+static const char *const scale_ops[SCALE_NUMOPS] = { "require", "imitate", "loaded_features", "close" };
+
+static uint64_t
+scale_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int
+scale_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static mrb_state *
+scale_open(void)
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+  if (mrb == NULL) {
+    fputs("mrb_open_core failed\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  return mrb;
+}
+
+/*
+ * "synth-" で始まる gem の名前を番号の昇順に集める
+ */
+static int
+scale_synth_names(const char ***namesp)
+{
+  mrb_state *mrb = scale_open();
+  mrb_value list = mruby_gemcut_loadable_features(mrb);
+  int num = 0;
+  const char **names = (const char **)malloc(sizeof(char *) * (RARRAY_LEN(list) + 1));
+  if (names == NULL) {
+    fputs("out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  for (mrb_int i = 0; i < RARRAY_LEN(list); i++) {
+    mrb_value v = RARRAY_PTR(list)[i];
+    if (RSTRING_LEN(v) > 6 && memcmp(RSTRING_PTR(v), "synth-", 6) == 0) {
+      char *name = (char *)malloc(RSTRING_LEN(v) + 1);
+      if (name == NULL) {
+        fputs("out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+      }
+      memcpy(name, RSTRING_PTR(v), RSTRING_LEN(v));
+      name[RSTRING_LEN(v)] = '\0';
+      names[num++] = name;
+    }
+  }
+
+  mrb_close(mrb);
+  *namesp = names;
+
+  return num;
+}
+
+static void
+scale_measure(int total, const char *const names[], int num, int repeat)
+{
+  uint64_t *samples = (uint64_t *)malloc(sizeof(uint64_t) * SCALE_NUMOPS * repeat);
+  if (samples == NULL) {
+    fputs("out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  int loaded = 0;
+  for (int r = 0; r < repeat; r++) {
+    uint64_t *s = samples + r;
+    mrb_state *mrb = scale_open();
+
+    uint64_t t = scale_now();
+    mruby_gemcut_require_many(mrb, names, num);
+    s[SCALE_REQUIRE * repeat] = scale_now() - t;
+    loaded = mruby_gemcut_loaded_count(mrb);
+
+    mrb_state *dest = scale_open();
+    t = scale_now();
+    mruby_gemcut_imitate_to(dest, mrb);
+    s[SCALE_IMITATE * repeat] = scale_now() - t;
+    mrb_close(dest);
+
+    int ai = mrb_gc_arena_save(mrb);
+    t = scale_now();
+    mruby_gemcut_loaded_features(mrb);
+    s[SCALE_LOADED_FEATURES * repeat] = scale_now() - t;
+    mrb_gc_arena_restore(mrb, ai);
+
+    t = scale_now();
+    mrb_close(mrb);
+    s[SCALE_CLOSE * repeat] = scale_now() - t;
+  }
+
+  for (int op = 0; op < SCALE_NUMOPS; op++) {
+    uint64_t *s = samples + op * repeat;
+    qsort(s, repeat, sizeof(s[0]), scale_compare);
+    printf("{\"total\":%d,\"loaded\":%d,\"op\":\"%s\",\"ns\":%llu}\n",
+           total, loaded, scale_ops[op], (unsigned long long)s[repeat / 2]);
+  }
+  fflush(stdout);
+
+  free(samples);
+}
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  const char *env = getenv("MRUBY_GEMCUT_SCALE_REPEAT");
+  int repeat = env ? atoi(env) : 11;
+  if (repeat < 1) {
+    repeat = 1;
+  }
+
+  const char **names;
+  int numsynth = scale_synth_names(&names);
+
+  mrb_state *mrb = scale_open();
+  int total = mruby_gemcut_loadable_count(mrb);
+  mrb_close(mrb);
+
+  for (int num = 1; num <= numsynth; num *= 8) {
+    scale_measure(total, names, num, repeat);
+  }
+
+  for (int i = 0; i < numsynth; i++) {
+    free((void *)names[i]);
+  }
+  free(names);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <mruby-gemcut.h>
+#include <mruby.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+# include <unistd.h>
+#endif
+
+/*
+ * mruby_gemcut_factory_run() で大量の mrb_state を構築しては破棄し、
+ * スレッド数を 1 から倍々に増やしたときの処理量を JSON Lines 形式で標準出力に書き出す。
+ *
+ *      {"threads":4,"vms":20000,"failures":0,"leaks":0,"vms_per_sec":12345,"scaling":3.50}
+ *
+ * スレッドごとに別の allocf の ud を与え、破棄した後に確保したままのブロックが残っていないことを確かめる。
+ * 構築した mrb_state の gem の数が期待と異なる場合も失敗として数える。
+ *
+ * 総数は環境変数 MRUBY_GEMCUT_STRESS_VMS で、スレッド数の上限は MRUBY_GEMCUT_STRESS_THREADS で変更できる。
+ */
+
+#define STRESS_PROFILE "printer"
+
+struct stress_thread
+{
+  long blocks;   /* 確保したままのメモリブロックの数 */
+  long failures; /* 構築に失敗したか、gem の数が期待と異なっていた数 */
+  char padding[64]; /* 隣のスレッドの記録とキャッシュラインを共有しないため */
+};
+
+struct stress
+{
+  int expected; /* 構築した mrb_state で初期化されているべき gem の数 */
+  struct stress_thread *threads;
+};
+
+static void *
+stress_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  (void)mrb;
+
+  struct stress_thread *st = (struct stress_thread *)ud;
+  if (size == 0) {
+    if (p) {
+      st->blocks--;
+    }
+    free(p);
+    return NULL;
+  }
+
+  void *q = realloc(p, size);
+  if (p == NULL && q != NULL) {
+    st->blocks++;
+  }
+  return q;
+}
+
+static void
+stress_consume(mrb_state *mrb, int index, int thread, void *opaque)
+{
+  (void)index;
+
+  struct stress *s = (struct stress *)opaque;
+  if (mrb == NULL) {
+    s->threads[thread].failures++;
+    return;
+  }
+
+  if (mruby_gemcut_loaded_count(mrb) != s->expected) {
+    s->threads[thread].failures++;
+  }
+
+  mrb_close(mrb);
+}
+
+static uint64_t
+stress_now(void)
+{
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int
+stress_cpus(void)
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) {
+    return (int)n;
+  }
+#endif
+
+  return 4;
+}
+
+static int
+stress_env(const char *name, int defval)
+{
+  const char *env = getenv(name);
+  int n = env ? atoi(env) : defval;
+  return (n < 1) ? 1 : n;
+}
+
+/*
+ * threads 個のスレッドで num 個の mrb_state を構築・破棄し、1 秒あたりの個数を返す。
+ */
+static double
+stress_run(int threads, int num, int expected, long *failures, long *leaks)
+{
+  struct stress_thread *list = (struct stress_thread *)calloc(threads, sizeof(struct stress_thread));
+  void **uds = (void **)calloc(threads, sizeof(void *));
+  if (list == NULL || uds == NULL) {
+    fputs("out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+
+  for (int t = 0; t < threads; t++) {
+    uds[t] = &list[t];
+  }
+
+  struct stress s = { expected, list };
+  struct mruby_gemcut_factory factory;
+  memset(&factory, 0, sizeof(factory));
+  factory.profile = STRESS_PROFILE;
+  factory.threads = threads;
+  factory.allocf = stress_allocf;
+  factory.allocf_uds = uds;
+  factory.func = stress_consume;
+  factory.opaque = &s;
+
+  uint64_t t0 = stress_now();
+  int built = mruby_gemcut_factory_run(&factory, num);
+  uint64_t elapsed = stress_now() - t0;
+
+  *failures = (built < 0) ? num : 0;
+  *leaks = 0;
+  for (int t = 0; t < threads; t++) {
+    *failures += list[t].failures;
+    *leaks += list[t].blocks;
+  }
+
+  free(uds);
+  free(list);
+
+  return (double)num * 1e9 / (double)(elapsed ? elapsed : 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+
+  int num = stress_env("MRUBY_GEMCUT_STRESS_VMS", 20000);
+  int maxthreads = stress_env("MRUBY_GEMCUT_STRESS_THREADS", stress_cpus());
+
+  /* 期待する gem の数は、同じプロファイルを初期化した mrb_state から求める */
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+  if (mrb == NULL || mrb_exception_p(mruby_gemcut_require_profile(mrb, STRESS_PROFILE))) {
+    fputs("cannot build the reference mrb_state\n", stderr);
+    return EXIT_FAILURE;
+  }
+  int expected = mruby_gemcut_loaded_count(mrb);
+  mrb_close(mrb);
+
+  double base = 0;
+  int status = EXIT_SUCCESS;
+  for (int threads = 1;; threads *= 2) {
+    if (threads > maxthreads) {
+      threads = maxthreads;
+    }
+
+    long failures, leaks;
+    double rate = stress_run(threads, num, expected, &failures, &leaks);
+    if (threads == 1) {
+      base = rate;
+    }
+
+    printf("{\"threads\":%d,\"vms\":%d,\"failures\":%ld,\"leaks\":%ld,\"vms_per_sec\":%.0f,\"scaling\":%.2f}\n",
+           threads, num, failures, leaks, rate, rate / base);
+    fflush(stdout);
+
+    if (failures != 0 || leaks != 0) {
+      status = EXIT_FAILURE;
+    }
+
+    if (threads >= maxthreads) {
+      break;
+    }
+  }
+
+  return status;
+}
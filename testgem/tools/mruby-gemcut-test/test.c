@@ -3,6 +3,11 @@
 #include <mruby/compile.h>
 #include <mruby/string.h>
 #include <stdarg.h>
+#include <string.h>
+
+static void load_string_main(mrb_state *mrb, mrb_bool need_module, const char ruby[]);
+
+MRUBY_GEMCUT_DECLARE_PROFILE_INIT(printer);
 
 static void
 load_string(mrb_bool need_module, const char ruby[], int numgemcut, ...)
@@ -18,12 +23,31 @@ load_string(mrb_bool need_module, const char ruby[], int numgemcut, ...)
     va_end(va);
   }
 
+  load_string_main(mrb, need_module, ruby);
+  mrb_close(mrb);
+}
+
+static void
+load_string_many(mrb_bool need_module, const char ruby[], size_t numgemcut, const char *const gemnames[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_defer_gc(mrb, TRUE);
+  mruby_gemcut_require_many(mrb, gemnames, numgemcut);
+
+  load_string_main(mrb, need_module, ruby);
+  mrb_close(mrb);
+}
+
+static void
+load_string_main(mrb_state *mrb, mrb_bool need_module, const char ruby[])
+{
   if (need_module) {
     mruby_gemcut_require(mrb, "mruby-gemcut");
   }
   mrb_value gems = mruby_gemcut_loaded_features(mrb);
   if (!mrb_nil_p(gems)) {
-    mrb_funcall_argv(mrb, gems, mrb_intern_cstr(mrb, "sort!"), 0, NULL);
+    gems = mrb_funcall_argv(mrb, gems, mrb_intern_cstr(mrb, "sort"), 0, NULL);
   }
   printf(">> loaded gems: %s\n", mrb_str_to_cstr(mrb, mrb_inspect(mrb, gems)));
   fflush(stdout);
@@ -35,10 +59,192 @@ load_string(mrb_bool need_module, const char ruby[], int numgemcut, ...)
     fprintf(stderr, "raised exceptions - %s\n", mrb_string_value_cstr(mrb, &ret));
     fflush(stderr);
   }
+}
+
+static void
+load_string_pooled(const char ruby[], const char *profile)
+{
+  struct mruby_gemcut_pool *pool = mruby_gemcut_pool_new(NULL, NULL, profile, 1, 2);
+  mrb_state *mrb = mruby_gemcut_pool_checkout(pool);
+
+  load_string_main(mrb, TRUE, ruby);
+  mruby_gemcut_pool_checkin(pool, mrb);
+
+  struct mruby_gemcut_pool_stats stats;
+  mruby_gemcut_pool_stats(pool, &stats);
+  printf(">> pool checkouts: %d\n", (int)(stats.hits + stats.misses));
+  fflush(stdout);
+
+  mruby_gemcut_pool_free(pool);
+}
+
+static void
+load_string_profile_init(const char ruby[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_init_printer(mrb);
+  load_string_main(mrb, TRUE, ruby);
+  mrb_close(mrb);
+}
+
+static void
+load_string_autoload(const char ruby[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_autoload(mrb);
+  load_string_main(mrb, TRUE, ruby);
+  mrb_close(mrb);
+}
+
+static void
+load_string_checkpoint(const char ruby[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_require(mrb, "mruby-gemcut");
+  mruby_gemcut_require(mrb, "mruby-print");
+  mruby_gemcut_checkpoint(mrb);
+  int before = 0, after = 0;
+  mruby_gemcut_stats(mrb, &before);
+  mruby_gemcut_require(mrb, "mruby-math");
+  mruby_gemcut_rollback(mrb);
+  mruby_gemcut_stats(mrb, &after);
+  printf(">> stats after rollback: %s\n", (after == before) ? "restored" : "kept");
+  fflush(stdout);
+  load_string_main(mrb, TRUE, ruby);
+  mrb_close(mrb);
+}
+
+static void
+load_string_budget(const char ruby[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_require(mrb, "mruby-gemcut");
+  mruby_gemcut_require(mrb, "mruby-print");
+  mrb_allocf allocf = mrb->allocf;
+  mrb_value ret = mruby_gemcut_require_with_budget(mrb, "mruby-math", 0, 1);
+  printf(">> budget: %s\n", mrb_exception_p(ret) ? mrb_str_to_cstr(mrb, mrb_inspect(mrb, ret)) : "not exceeded");
+  printf(">> budget allocf restored: %s\n", (mrb->allocf == allocf) ? "true" : "false");
+  fflush(stdout);
+  load_string_main(mrb, TRUE, ruby);
+  mrb_close(mrb);
+}
+
+static void
+load_string_fingerprint(const char ruby[], size_t numgemcut, const char *const gemnames[])
+{
+  mrb_state *src = mrb_open_core(mrb_default_allocf, NULL);
+  mruby_gemcut_require_many(src, gemnames, numgemcut);
+  char fp[256];
+  mruby_gemcut_fingerprint(src, fp, sizeof(fp));
+  mrb_close(src);
+
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+  mrb_value ret = mruby_gemcut_apply_fingerprint(mrb, fp);
+  printf(">> apply fingerprint: %s\n", mrb_str_to_cstr(mrb, mrb_inspect(mrb, ret)));
+  ret = mruby_gemcut_apply_fingerprint(mrb, "00000000-1");
+  printf(">> apply foreign fingerprint: %s\n", mrb_str_to_cstr(mrb, mrb_inspect(mrb, ret)));
+
+  /* ビットマップに収まらない長さの 0 の並び */
+  char longfp[sizeof(fp) + 4096];
+  size_t head = strcspn(fp, "-") + 1;
+  memcpy(longfp, fp, head);
+  memset(longfp + head, '0', sizeof(longfp) - head - 1);
+  longfp[sizeof(longfp) - 1] = '\0';
+  ret = mruby_gemcut_apply_fingerprint(mrb, longfp);
+  printf(">> apply oversized fingerprint: %s\n", mrb_obj_classname(mrb, ret));
+  fflush(stdout);
+  load_string_main(mrb, TRUE, ruby);
+  mrb_close(mrb);
+}
+
+static void
+hook_print(mrb_state *mrb, enum mruby_gemcut_hook_event event, int id, const char *name, mrb_bool ok, void *ud)
+{
+  (void)mrb;
+  (void)id;
+
+  if (strcmp(name, "mruby-math") == 0) {
+    printf(">> hook: %s %s %s%s\n", (const char *)ud, event == MRUBY_GEMCUT_HOOK_INIT ? "init" : "final", name, ok ? "" : " (failed)");
+    fflush(stdout);
+  }
+}
+
+static void
+hook_before(mrb_state *mrb, enum mruby_gemcut_hook_event event, int id, const char *name, mrb_bool ok, void *ud)
+{
+  (void)ud;
+  hook_print(mrb, event, id, name, ok, (void *)"before");
+}
+
+static void
+hook_after(mrb_state *mrb, enum mruby_gemcut_hook_event event, int id, const char *name, mrb_bool ok, void *ud)
+{
+  (void)ud;
+  hook_print(mrb, event, id, name, ok, (void *)"after");
+}
+
+static void
+load_string_hooks(const char ruby[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_set_hooks(mrb, hook_before, hook_after, NULL);
+  mruby_gemcut_require(mrb, "mruby-print");
+  load_string_main(mrb, TRUE, ruby);
+  mrb_close(mrb);
+}
+
+static void
+hook_final_order(mrb_state *mrb, enum mruby_gemcut_hook_event event, int id, const char *name, mrb_bool ok, void *ud)
+{
+  (void)mrb;
+  (void)id;
+  (void)ok;
+  (void)ud;
+
+  if (event == MRUBY_GEMCUT_HOOK_FINAL &&
+      (strcmp(name, "mruby-hash-ext") == 0 || strcmp(name, "mruby-math") == 0 || strcmp(name, "mruby-sprintf") == 0)) {
+    printf(">> final: %s\n", name);
+    fflush(stdout);
+  }
+}
 
+/*
+ * gem_final が番号の順ではなく、初期化した順とは逆に呼び出されることを確かめる
+ */
+static void
+load_string_final_order(size_t numgems, const char *const gemnames[])
+{
+  mrb_state *mrb = mrb_open_core(mrb_default_allocf, NULL);
+
+  mruby_gemcut_set_hooks(mrb, NULL, hook_final_order, NULL);
+  for (size_t i = 0; i < numgems; i++) {
+    mruby_gemcut_require(mrb, gemnames[i]);
+  }
   mrb_close(mrb);
 }
 
+static void
+load_string_imitated(const char ruby[], size_t numgemcut, const char *const gemnames[])
+{
+  mrb_state *src = mrb_open_core(mrb_default_allocf, NULL);
+  mruby_gemcut_require_many(src, gemnames, numgemcut);
+
+  mrb_state *dests[2] = { mrb_open_core(mrb_default_allocf, NULL), mrb_open_core(mrb_default_allocf, NULL) };
+  printf(">> imitate failures: %d\n", mruby_gemcut_imitate_to_many(dests, 2, src));
+  fflush(stdout);
+  mrb_close(src);
+
+  for (int i = 0; i < 2; i++) {
+    load_string_main(dests[i], TRUE, ruby);
+    mrb_close(dests[i]);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -60,5 +266,36 @@ main(int argc, char *argv[])
   load_string(TRUE, "Gemcut.require 'mruby-gemcut'; Gemcut.require 'mruby-print'; p Gemcut.loaded_features.sort", 0);
   load_string(TRUE, "Gemcut.require 'mruby-hash-ext'; Gemcut.require 'mruby-print'; p Gemcut.loaded_features.sort", 0);
 
+  {
+    static const char *const gems[] = { "mruby-math", "print" };
+    load_string_many(TRUE, "p Gemcut.loaded_features.sort", 2, gems);
+  }
+  load_string(TRUE, "Gemcut.require 'mruby-sprintf', 'print'; p Gemcut.loaded_features.sort", 0);
+  load_string(TRUE, "begin; Gemcut.require 'mruby-math', 'no-such-gem'; rescue LoadError => e; p e.class; end; p Gemcut.loaded_feature?('mruby-math')", 1, "mruby-print");
+  load_string(TRUE, "Gemcut.require_profile 'printer'; p Gemcut.loaded_features.sort", 0);
+  load_string(TRUE, "begin; Gemcut.require_profile 'no-such-profile'; rescue LoadError => e; p e.class; end", 1, "mruby-print");
+  load_string_pooled("p Gemcut.loaded_features.sort", "printer");
+  {
+    static const char *const gems[] = { "mruby-math", "mruby-print" };
+    load_string_imitated("p Gemcut.loaded_features.sort", 2, gems);
+  }
+  load_string_autoload("p Math.sin(5).floor; p Gemcut.loaded_features.sort");
+  load_string_autoload("p((String::Math rescue :NameError)); p Gemcut.loaded_features.sort");
+  load_string_profile_init("p Gemcut.loaded_features.sort");
+  load_string_checkpoint("p Object.const_defined?(:Math); p Gemcut.loaded_features.sort");
+  load_string(TRUE, "p Gemcut.dependencies('hash-ext'); p Gemcut.dependents('array-ext').include?('mruby-hash-ext'); "
+                    "p Gemcut.closure('hash-ext'); p Gemcut.closure('hash-ext', exclude_loaded: false)", 2, "mruby-print", "mruby-array-ext");
+  load_string(TRUE, "p Gemcut.estimated_cost(['hash-ext', 'math'])[:gems]; p Gemcut.estimated_cost('print')[:gems]", 1, "mruby-print");
+  load_string_budget("p Object.const_defined?(:Math); Gemcut.require 'math'; p Math.sqrt(4)");
+  {
+    static const char *const gems[] = { "mruby-gemcut", "mruby-math", "mruby-print" };
+    load_string_fingerprint("p Gemcut.fingerprint.length > 9", 3, gems);
+  }
+  load_string_hooks("Gemcut.require 'math'; p Math.sqrt(4)");
+  {
+    static const char *const gems[] = { "mruby-hash-ext", "mruby-math", "mruby-sprintf" };
+    load_string_final_order(3, gems);
+  }
+
   return 0;
 }